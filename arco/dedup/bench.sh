@@ -0,0 +1,73 @@
+# Recall/runtime benchmark for dedup on a synthetic near-duplicate corpus
+# ls ../sources/*.jpg | head -100 > seeds.txt
+# sh bench.sh seeds.txt bench.csv
+# Each configuration is built with its own -D overrides, run over the whole
+# corpus, and scored against the generator's truth file. One CSV row per run.
+# Exact runs keep the default N_PROJS (the search is chosen at run time, by
+# --lsh) and leave n_projs empty.
+# The corpus is generated once into $work; remove it to regenerate.
+
+seeds=$1
+csv=${2:-bench.csv}
+work=${work:-${TMPDIR:-/tmp}/dedup-bench}
+jobs=${jobs:-0}
+dist_limits=${dist_limits:-"20 30 40"}
+n_projs_list=${n_projs_list:-"100 300"}
+
+if [ -z "$seeds" ] || [ ! -f "$seeds" ]; then
+  echo "Usage: $0 <seed image list> [<output CSV>]"
+  exit 1
+fi
+
+set -e
+mkdir -p $work/corpus
+cc=${CC:-gcc}
+$cc -o $work/gencorpus -O2 gencorpus.c -I ../../aux -lm
+
+if [ ! -f "$work/truth.txt" ]; then
+  echo "Generating corpus in $work/corpus"
+  $work/gencorpus $work/corpus $work/truth.txt 1 < $seeds > /dev/null
+fi
+cut -f 2 $work/truth.txt > $work/list.txt
+
+# Precision and recall of a pair list ("dist -- a b") against the truth file
+score() {
+  awk -F '\t' -v pairs="$1" '
+    FNR == NR { group[$2] = $1; size[$1]++; next }
+    END {
+      for (g in size) n_true += size[g] * (size[g] - 1) / 2
+      while ((getline line < pairs) > 0) {
+        if (split(line, f, " ") != 4 || f[2] != "--") continue
+        n_reported++
+        if ((f[3] in group) && (f[4] in group) && group[f[3]] == group[f[4]]) n_hit++
+      }
+      printf "%.4f,%.4f", (n_reported ? n_hit / n_reported : 1), (n_true ? n_hit / n_true : 1)
+    }' $work/truth.txt
+}
+
+echo "search,dist_limit,n_projs,images,ingest_s,images_per_s,search_s,pairs,pairs_per_s,maxrss_kb,precision,recall" > $csv
+
+run() {
+  search=$1; dl=$2; np=$3
+  bin=$work/dedup-$dl${np:+-$np}
+  $cc -o $bin -O2 -DDIST_LIMIT=$dl ${np:+-DN_PROJS=$np} \
+    dedup.c jpegdc.c hamming.c -I ../../aux -lm -lpthread
+  flags="-j $jobs -s"
+  if [ "$search" = "lsh" ]; then flags="$flags --lsh"; fi
+  $bin $flags < $work/list.txt > $work/pairs.txt 2> $work/log.txt
+  stats=`grep '^stats ' $work/log.txt`
+  get() { echo "$stats" | tr ' ' '\n' | grep "^$1=" | cut -d= -f2; }
+  images=`get images`; ingest_s=`get ingest_s`; search_s=`get search_s`
+  pairs=`get pairs`; maxrss_kb=`get maxrss_kb`
+  rates=`awk -v i=$images -v ti=$ingest_s -v p=$pairs -v ts=$search_s \
+    'BEGIN { printf "%.1f,%.1f", (ti > 0 ? i / ti : 0), (ts > 0 ? p / ts : 0) }'`
+  images_per_s=${rates%,*}; pairs_per_s=${rates#*,}
+  echo "$search,$dl,$np,$images,$ingest_s,$images_per_s,$search_s,$pairs,$pairs_per_s,$maxrss_kb,`score $work/pairs.txt`" | tee -a $csv
+}
+
+for dl in $dist_limits; do
+  run exact $dl ""
+  for np in $n_projs_list; do
+    run lsh $dl $np
+  done
+done
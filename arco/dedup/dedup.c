@@ -1,217 +1,2835 @@
+// gcc -o dedup -O2 dedup.c jpegdc.c hamming.c -I ../../aux -lm -lpthread
+// ls ../sources/*.jpg | ./dedup -j 0 -c dedup.cache
 #define STB_IMAGE_IMPLEMENTATION
 #include "stb_image.h"
 #define STB_IMAGE_RESIZE_IMPLEMENTATION
 #include "stb_image_resize.h"
 
 #include <ctype.h>
+#include <errno.h>
+#include <getopt.h>
 #include <math.h>
+#include <pthread.h>
+#include <signal.h>
 #include <stdbool.h>
 #include <stdint.h>
 #include <stdio.h>
 #include <string.h>
+#include <stdlib.h>
+#include <sys/resource.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+unsigned char *jpeg_load_dc(const char *path, int *o_w, int *o_h, int *o_sw, int *o_sh);
+void hamming_init();
+extern void (*hamming_batch)(
+  const uint64_t q[3], uint64_t *const h[3],
+  const uint32_t *ids, size_t n, uint8_t *o_dist);
+
+// Growable arrays
+// The record arrays and the name arena never move: each reserves address
+// space for its largest size when first used, and pages are made usable as
+// it grows, so growing copies nothing and untouched pages cost no memory.
+// Hash rows stay contiguous for the gathers in hamming.c.
+#define MAX_RECORDS ((size_t)1 << 30)
+
+static void *vm_reserve(size_t bytes)
+{
+  void *p = mmap(NULL, bytes, PROT_NONE,
+    MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+  if (p == MAP_FAILED) {
+    printf("Cannot reserve %zu MiB of address space\n", bytes >> 20);
+    exit(1);
+  }
+  return p;
+}
+
+// Makes the first `bytes` bytes of `p`, from vm_reserve(), usable
+static void vm_commit(void *p, size_t bytes)
+{
+  if (mprotect(p, bytes, PROT_READ | PROT_WRITE) != 0) {
+    printf("Out of memory\n");
+    exit(1);
+  }
+}
 
 typedef struct record {
-  const char *name;
-  uint64_t hash[3];
+  uint64_t size;  // File size in bytes
+  int64_t mtime;  // Modification time in seconds
+  uint32_t name;  // Offset of the path in name_arena (see rec_name())
+  int w, h;
 } record;
 record *records = NULL;
 size_t n_records = 0, cap_records = 0;
+// Hashes of the records in structure-of-arrays layout, 64-byte aligned:
+// word t of the hash of record i is hashes[t][i]
+uint64_t *hashes[3];
+
+// Records removed from a served index (--serve), until it is next saved;
+// NULL if not serving
+uint8_t *removed = NULL;
+size_t n_removed = 0;
+
+static inline bool rec_removed(size_t i)
+{
+  return removed != NULL && removed[i];
+}
 
-static inline void dct(int n, float *x, int stride, bool inverse)
+// Worker threads for ingestion and for index building (-j)
+int n_threads = 1;
+
+static inline void get_hash(size_t i, uint64_t o_hash[3])
+{
+  o_hash[0] = hashes[0][i];
+  o_hash[1] = hashes[1][i];
+  o_hash[2] = hashes[2][i];
+}
+
+// Record names are the bulk of the per-image memory. They are appended,
+// NUL-terminated, to one arena addressed by 32-bit offsets; in out-of-core
+// mode (-m) they go to an unlinked temporary file instead, and are read back
+// with rec_name() when printed.
+#define NAME_ARENA_MAX ((size_t)1 << 32)
+static char *name_arena = NULL;
+static size_t name_arena_len = 0, name_arena_cap = 0;
+
+// Appends `len` bytes of `name` and a NUL to the arena, returning the offset
+static uint32_t name_add(const char *name, size_t len)
 {
-  float y[n];
-  if (!inverse) for (int i = 0; i < n; i++) {
-    y[i] = 0;
-    for (int j = 0; j < n; j++)
-      y[i] += x[j * stride] * cosf((float)M_PI / n * i * (j + 0.5f));
-  } else for (int i = 0; i < n; i++) {
-    y[i] = x[0] / 2;
-    for (int j = 1; j < n; j++)
-      y[i] += x[j * stride] * cosf((float)M_PI / n * j * (i + 0.5f));
-    y[i] *= (2.0f / n);
+  if (name_arena == NULL) name_arena = (char *)vm_reserve(NAME_ARENA_MAX);
+  if (name_arena_len + len + 1 > name_arena_cap) {
+    if (name_arena_len + len + 1 > NAME_ARENA_MAX) {
+      printf("Paths exceed %zu GiB in total\n", NAME_ARENA_MAX >> 30);
+      exit(1);
+    }
+    while (name_arena_len + len + 1 > name_arena_cap)
+      name_arena_cap = (name_arena_cap == 0 ? 1 << 16 : name_arena_cap * 2);
+    vm_commit(name_arena, name_arena_cap);
   }
-  for (int i = 0; i < n; i++) x[i * stride] = y[i];
+  uint32_t off = name_arena_len;
+  memcpy(name_arena + off, name, len);
+  name_arena[off + len] = '\0';
+  name_arena_len += len + 1;
+  return off;
 }
 
-void process(const char *path)
+static FILE *names_fp = NULL;
+static uint64_t *name_off = NULL;  // Offset of each record's name in names_fp
+static uint64_t names_len = 0;
+
+// Name of record i; with spilled names, the returned string is only valid
+// until the next call from the same thread
+static const char *rec_name(size_t i)
 {
-  printf("Processing %s", path);
-  // Read image (converted to greyscale by stbi__compute_y)
-  int w, h;
-  unsigned char *pix = stbi_load(path, &w, &h, NULL, 1);
-  if (pix == NULL) {
-    printf(" -- Cannot open! Ignoring > <\n");
-    return;
+  if (names_fp == NULL) return name_arena + records[i].name;
+  static _Thread_local char *buf = NULL;
+  static _Thread_local size_t cap = 0;
+  uint64_t end = (i + 1 < n_records ? name_off[i + 1] : names_len);
+  size_t len = end - name_off[i];  // Including the terminating NUL
+  if (len > cap) {
+    cap = len;
+    buf = (char *)realloc(buf, cap);
   }
-  printf(" (%dx%d)\n", w, h);
-  // Scale image
-  unsigned char pix_s1[32][32];
-  stbir_resize_uint8_srgb(
-    pix, w, h, 0,
-    &pix_s1[0][0], 32, 32, 0,
-    1, STBIR_ALPHA_CHANNEL_NONE, 0);
-  stbi_image_free(pix);
+  if (pread(fileno(names_fp), buf, len, name_off[i]) != (ssize_t)len) {
+    printf("Cannot read spilled names\n");
+    exit(1);
+  }
+  return buf;
+}
+
+// 32-point DCT-II, keeping only the 8 lowest-frequency coefficients
+// dct_cos[j][i] = cos(pi/32 * i * (j + 1/2)), laid out so that
+// the inner loop over the 8 outputs is contiguous and vectorises
+#define DCT_N 32
+#define DCT_K 8
+static float dct_cos[DCT_N][DCT_K];
+
+void dct_init()
+{
+  for (int j = 0; j < DCT_N; j++)
+    for (int i = 0; i < DCT_K; i++)
+      dct_cos[j][i] = cosf((float)M_PI / DCT_N * i * (j + 0.5f));
+}
+
+// y[i * ystride] = sum_j x[j * xstride] * cos(pi/32 * i * (j + 1/2)), i < 8
+// Summation order matches the naive transform, so results are bit-identical
+static inline void dct32_low8(
+  const float *restrict x, int xstride, float *restrict y, int ystride)
+{
+  float acc[DCT_K] = { 0 };
+  for (int j = 0; j < DCT_N; j++) {
+    float xj = x[j * xstride];
+    for (int i = 0; i < DCT_K; i++)
+      acc[i] += xj * dct_cos[j][i];
+  }
+  for (int i = 0; i < DCT_K; i++) y[i * ystride] = acc[i];
+}
+
+// Decode baseline JPEGs at 1/8 scale from their DC coefficients (see
+// jpegdc.c), as long as the reduced raster is at least REDUCED_MIN_SIZE
+// on both sides; other images are decoded in full. Hashes differ slightly
+// from those of full decodes, so this is opt-in and tracked in the cache.
+bool reduced_decode = false;
+#define REDUCED_MIN_SIZE 64
+
+// Orientations (-o)
+// Mirrored and rotated copies are matched by also indexing the hashes of the
+// 8 dihedral transforms of each image. Variant v mirrors columns if bit 0 is
+// set, then rows if bit 1 is set, then transposes if bit 2 is set; variant 0
+// is the image itself. They are derived from the 8x8 DCT block and the 8x8
+// raster: mirroring negates the odd-frequency coefficients along that axis
+// and transposing transposes the block, so no pixels are resampled again.
+bool dihedral = false;
+#define N_ORIENT 8
+// Hashes of all orientations, in the layout of `hashes` with one row per
+// orientation: word t of variant v of record i is var_hashes[t][i * N_ORIENT + v]
+uint64_t *var_hashes[3];
+
+static inline void get_var(size_t i, int v, uint64_t o_hash[3])
+{
+  for (int t = 0; t < 3; t++) o_hash[t] = var_hashes[t][i * N_ORIENT + v];
+}
 
+// Tiles (-t)
+// For crops, overlapping windows are hashed as well, at several scales so
+// that a crop can line up with some window of the full image. The decoded
+// image is resampled once more, to TILE_RASTER x TILE_RASTER, and from that
+// into a pyramid of levels 32 + l * TILE_STEP pixels wide; every 32 x 32
+// window at TILE_STEP intervals of every level is hashed like a whole image
+// (its DCT needs no further resampling). Level 0 is the image itself, whose
+// hashes are the global ones. Windows that are flat or a plain gradient,
+// such as empty sky, are left out, as they would match regardless of the
+// image.
+bool tiled = false;
+#ifndef TILE_RASTER
+#define TILE_RASTER 64
+#endif
+#ifndef TILE_STEP
+#define TILE_STEP 8
+#endif
+// Pairs are reported if this many tiles of one image each match a tile of
+// the other (within TILE_DIST, below), all under the same scale and offset,
+// and the mean distance over all pairs of tiles that overlap under them is
+// at most TILE_MEAN_DIST
+#ifndef TILE_MIN_AGREE
+#define TILE_MIN_AGREE 3
+#endif
+#ifndef TILE_MEAN_DIST
+#define TILE_MEAN_DIST 24
+#endif
+// Least amplitude, in grey levels, of the DCT terms past the first order
+#ifndef TILE_MIN_DETAIL
+#define TILE_MIN_DETAIL 4
+#endif
+#define TILE_LEVELS ((TILE_RASTER - 32) / TILE_STEP + 1)
+// Level l has (l + 1) x (l + 1) windows
+#define N_TILES (TILE_LEVELS * (TILE_LEVELS + 1) * (2 * TILE_LEVELS + 1) / 6)
+_Static_assert(N_TILES <= 64, "tile masks have one bit per tile");
+_Static_assert(TILE_STEP % 4 == 0, "windows are also cut from quarter-size levels");
+// Level and window position of each tile
+struct { uint8_t l, x, y; } tile_geom[N_TILES];
+// Hashes of all tiles, one row per tile as in var_hashes, and for each
+// record the mask of tiles that were hashed
+uint64_t *tile_hashes[3];
+uint64_t *tile_masks;
+
+static inline void get_tile(size_t i, int a, uint64_t o_hash[3])
+{
+  for (int t = 0; t < 3; t++) o_hash[t] = tile_hashes[t][i * N_TILES + a];
+}
+
+void tile_init_geom()
+{
+  int a = 0;
+  for (int l = 0; l < TILE_LEVELS; l++)
+    for (int y = 0; y <= l; y++)
+      for (int x = 0; x <= l; x++) {
+        tile_geom[a].l = l;
+        tile_geom[a].x = x;
+        tile_geom[a].y = y;
+        a++;
+      }
+}
+
+// Hashes besides the global one, as enabled by -o and -t
+typedef struct hash_set {
+  uint64_t var[N_ORIENT][3];
+  uint64_t tile[N_TILES][3];
+  uint64_t tile_mask;
+} hash_set;
+
+// pHash from the low 8x8 DCT block, dHashes from the 8x8 raster
+static void hash_blocks(const float f[8][8], const unsigned char p[8][8],
+  uint64_t o_hash[3])
+{
   // Perceptual hash
   // https://www.hackerfactor.com/blog/index.php?/archives/432-Looks-Like-It.html
   uint64_t phash = 0;
-  float pix_s1f[32][32];
-  for (int r = 0; r < 32; r++)
-    for (int c = 0; c < 32; c++)
-      pix_s1f[r][c] = pix_s1[r][c];
-  // 2D DCT-II
-  for (int i = 0; i < 32; i++) dct(32, &pix_s1f[i][0], 1, false);
-  for (int i = 0; i < 32; i++) dct(32, &pix_s1f[0][i], 32, false);
   // Reduction
   float average = 0;
   for (int r = 0; r < 8; r++)
     for (int c = !r; c < 8; c++)
-      average += pix_s1f[r][c];
+      average += f[r][c];
   average /= 63;
   for (int r = 0; r < 8; r++)
     for (int c = !r; c < 8; c++)
-      phash |= ((uint64_t)(pix_s1f[r][c] >= average) << (r * 8 + c));
-  phash |= (pix_s1f[0][0] >= 127.5);
+      phash |= ((uint64_t)(f[r][c] >= average) << (r * 8 + c));
+  phash |= (f[0][0] >= 127.5);
 
   // Difference hash
-  unsigned char pix_s2[8][8];
-  stbir_resize_uint8_srgb(
-    pix, w, h, 0,
-    &pix_s2[0][0], 8, 8, 0,
-    1, STBIR_ALPHA_CHANNEL_NONE, 0);
   uint64_t dhash1 = 0, dhash2 = 0;
   for (int r = 0; r < 8; r++)
     for (int c = 0; c < 8; c++) {
       dhash1 |= ((uint64_t)
-        (pix_s2[r][c] > pix_s2[r][(c + 1) % 8])) << (r * 8 + c);
+        (p[r][c] > p[r][(c + 1) % 8])) << (r * 8 + c);
       dhash2 |= ((uint64_t)
-        (pix_s2[r][c] > pix_s2[(r + 1) % 8][c])) << (r * 8 + c);
+        (p[r][c] > p[(r + 1) % 8][c])) << (r * 8 + c);
     }
 
   // printf("%016llx %016llx %016llx\n", phash, dhash1, dhash2);
-  // Append to records list
-  if (n_records >= cap_records) {
-    cap_records = (cap_records == 0 ? 32 : (cap_records * 2));
-    records = (record *)realloc(records, sizeof(record) * cap_records);
-  }
-  records[n_records].name = strdup(path);
-  records[n_records].hash[0] = phash;
-  records[n_records].hash[1] = dhash1;
-  records[n_records].hash[2] = dhash2;
-  n_records++;
+  o_hash[0] = phash;
+  o_hash[1] = dhash1;
+  o_hash[2] = dhash2;
 }
 
-#define N_PROJS 300
-#define DIST_LIMIT 30
-#define RANGE (DIST_LIMIT / 2)
-typedef struct proj {
-  size_t record_id;
-  float val;
-} proj;
-proj *projs[N_PROJS];
-size_t *proj_recpos[N_PROJS];
+// 2D DCT-II of a 32x32 block, separable; only the top-left 8x8 is kept
+static void dct_block(const unsigned char *p, int stride, float o_f[8][8])
+{
+  float pc[32][32];
+  for (int r = 0; r < 32; r++)
+    for (int c = 0; c < 32; c++)
+      pc[r][c] = p[r * stride + c];
+  float pr[32][8];
+  for (int r = 0; r < 32; r++) dct32_low8(&pc[r][0], 1, &pr[r][0], 1);
+  for (int c = 0; c < 8; c++) dct32_low8(&pr[0][c], 8, &o_f[0][c], 8);
+}
 
-int proj_cmp(const void *_a, const void *_b)
+// Windows whose DCT block has little energy past the first order, i.e. that
+// are flat or a plain gradient, have hashes that say more about the lighting
+// than the content
+static bool flat_window(const float f[8][8])
 {
-  proj *a = (proj *)_a;
-  proj *b = (proj *)_b;
-  return (a->val < b->val ? -1 : a->val > b->val ? 1 : 0);
+  float e = 0;
+  for (int r = 0; r < 8; r++)
+    for (int c = 0; c < 8; c++)
+      if (r + c >= 2) e += f[r][c] * f[r][c];
+  // An amplitude of A grey levels gives coefficients of about 256 A
+  return e < (256.0f * TILE_MIN_DETAIL) * (256.0f * TILE_MIN_DETAIL);
 }
 
-size_t projs_binsearch(const proj *p, float val)
+// Hashes the tiles of level 1 and up from `raster`; level 0 is the image at
+// 32x32 with DCT block `pix_s1f` and hashes `hash`
+// Each level is also scaled to a quarter once, where the 8x8 rasters of its
+// windows (for the dHashes) are found at a quarter of their offsets
+static void hash_tiles(const unsigned char raster[TILE_RASTER][TILE_RASTER],
+  const float pix_s1f[8][8], const uint64_t hash[3], hash_set *o_extra)
 {
-  ssize_t l = -1, r = n_records;
-  while (l < r - 1) {
-    size_t m = (l + r) / 2;
-    if (p[m].val >= val) r = m; else l = m;
+  o_extra->tile_mask = 0;
+  if (!flat_window(pix_s1f)) {
+    memcpy(o_extra->tile[0], hash, sizeof(uint64_t) * 3);
+    o_extra->tile_mask = 1;
+  }
+  unsigned char level[TILE_RASTER * TILE_RASTER];
+  unsigned char quarter[TILE_RASTER / 4 * TILE_RASTER / 4];
+  for (int a = 1; a < N_TILES; a++) {
+    int l = tile_geom[a].l, size = 32 + l * TILE_STEP;
+    const unsigned char *p = (size < TILE_RASTER ? level : &raster[0][0]);
+    // Resampled when its first window comes up
+    if (tile_geom[a].x == 0 && tile_geom[a].y == 0) {
+      if (size < TILE_RASTER)
+        stbir_resize_uint8_srgb(
+          &raster[0][0], TILE_RASTER, TILE_RASTER, 0,
+          level, size, size, 0,
+          1, STBIR_ALPHA_CHANNEL_NONE, 0);
+      stbir_resize_uint8_srgb(
+        p, size, size, 0,
+        quarter, size / 4, size / 4, 0,
+        1, STBIR_ALPHA_CHANNEL_NONE, 0);
+    }
+    int x = tile_geom[a].x * TILE_STEP, y = tile_geom[a].y * TILE_STEP;
+    float f[8][8];
+    dct_block(p + y * size + x, size, f);
+    if (flat_window(f)) continue;
+    unsigned char s[8][8];
+    for (int r = 0; r < 8; r++)
+      memcpy(s[r], quarter + (y / 4 + r) * (size / 4) + x / 4, 8);
+    hash_blocks(f, s, o_extra->tile[a]);
+    o_extra->tile_mask |= (uint64_t)1 << a;
   }
-  return r;
 }
 
-static inline float randuniform()
+// Computes the perceptual hash and the two difference hashes of an image,
+// and if `o_extra` is not NULL, those of its orientations (-o; var[0] being
+// the same as o_hash) and tiles (-t)
+// Returns false if the image cannot be read
+// Thread-safe; touches no global state besides the read-only DCT table
+bool hash_image(const char *path, uint64_t o_hash[3], hash_set *o_extra,
+  int *o_w, int *o_h)
 {
-  return (float)rand() / RAND_MAX;
+  int w, h;    // Original size
+  int sw, sh;  // Size of the decoded raster
+  unsigned char *pix = NULL;
+  if (reduced_decode) {
+    pix = jpeg_load_dc(path, &w, &h, &sw, &sh);
+    if (pix != NULL && (sw < REDUCED_MIN_SIZE || sh < REDUCED_MIN_SIZE)) {
+      free(pix);
+      pix = NULL;
+    }
+  }
+  if (pix == NULL) {
+    // Read image (converted to greyscale by stbi__compute_y)
+    pix = stbi_load(path, &w, &h, NULL, 1);
+    if (pix == NULL) return false;
+    sw = w;
+    sh = h;
+  }
+  *o_w = w;
+  *o_h = h;
+  // Scale image
+  // The source is scanned once into 32x32, which the 8x8 level is made from
+  unsigned char pix_s1[32][32];
+  stbir_resize_uint8_srgb(
+    pix, sw, sh, 0,
+    &pix_s1[0][0], 32, 32, 0,
+    1, STBIR_ALPHA_CHANNEL_NONE, 0);
+  // With tiles, also into TILE_RASTER x TILE_RASTER; kept apart from the
+  // above so that the global hashes do not depend on -t
+  unsigned char raster[TILE_RASTER][TILE_RASTER];
+  bool want_tiles = (tiled && o_extra != NULL);
+  if (want_tiles)
+    stbir_resize_uint8_srgb(
+      pix, sw, sh, 0,
+      &raster[0][0], TILE_RASTER, TILE_RASTER, 0,
+      1, STBIR_ALPHA_CHANNEL_NONE, 0);
+  stbi_image_free(pix);
+  unsigned char pix_s2[8][8];
+  stbir_resize_uint8_srgb(
+    &pix_s1[0][0], 32, 32, 0,
+    &pix_s2[0][0], 8, 8, 0,
+    1, STBIR_ALPHA_CHANNEL_NONE, 0);
+
+  float pix_s1f[8][8];
+  dct_block(&pix_s1[0][0], 32, pix_s1f);
+
+  hash_blocks(pix_s1f, pix_s2, o_hash);
+  if (want_tiles) hash_tiles(raster, pix_s1f, o_hash, o_extra);
+  if (dihedral && o_extra != NULL) {
+    uint64_t (*o_var)[3] = o_extra->var;
+    memcpy(o_var[0], o_hash, sizeof(uint64_t) * 3);
+    for (int v = 1; v < N_ORIENT; v++) {
+      bool flip_c = v & 1, flip_r = v & 2, transpose = v & 4;
+      float f[8][8];
+      unsigned char p[8][8];
+      for (int r = 0; r < 8; r++)
+        for (int c = 0; c < 8; c++) {
+          int sr = (transpose ? c : r), sc = (transpose ? r : c);
+          bool neg = (flip_r && (sr & 1)) != (flip_c && (sc & 1));
+          f[r][c] = (neg ? -pix_s1f[sr][sc] : pix_s1f[sr][sc]);
+          p[r][c] = pix_s2[flip_r ? 7 - sr : sr][flip_c ? 7 - sc : sc];
+        }
+      hash_blocks(f, p, o_var[v]);
+    }
+  }
+  return true;
 }
-static inline float randnorm()
+
+// Hash cache
+// Layout: cache_header, then for each entry a cache_ent immediately followed
+// by `path_len` bytes of path (not NUL-terminated), all in native byte order.
+// Entries with CACHE_FLAG_ORIENT then hold the hashes of orientations 1 to
+// N_ORIENT - 1 (see -o), and entries with CACHE_FLAG_TILES the tile mask and
+// the hashes of all tiles (see -t). The whole file is read in one go and
+// indexed by an open-addressing table over paths; an entry is reused only
+// if both size and mtime still match.
+
+#define CACHE_MAGIC "dedupc3"
+#define CACHE_MAGIC_V2 "dedupc2"  // Same layout, never has CACHE_FLAG_ORIENT
+typedef struct cache_header {
+  char magic[8];
+  uint64_t n;
+} cache_header;
+typedef struct cache_ent {
+  uint64_t hash[3];
+  uint64_t size;
+  int64_t mtime;
+  int32_t w, h;
+  uint32_t path_len, flags;
+} cache_ent;
+#define CACHE_FLAG_REDUCED 1
+#define CACHE_FLAG_ORIENT 2
+#define CACHE_FLAG_TILES 4
+// With CACHE_FLAG_TILES, bits 8-15 of the flags hold TILE_RASTER and bits
+// 16-23 TILE_STEP, so that tiles of another geometry are not mistaken for ours
+#define CACHE_TILE_GEOM_MASK 0xffff00u
+#define CACHE_TILE_GEOM ((uint32_t)TILE_RASTER << 8 | (uint32_t)TILE_STEP << 16)
+#define CACHE_ORIENT_BYTES (sizeof(uint64_t) * 3 * (N_ORIENT - 1))
+#define CACHE_TILE_BYTES (sizeof(uint64_t) + sizeof(uint64_t) * 3 * N_TILES)
+
+static inline size_t cache_tile_bytes(uint32_t flags)
 {
-  float u = randuniform();
-  float v = randuniform();
-  return sqrtf(-2 * logf(u)) * cosf((float)M_PI * 2 * v);
+  if (!(flags & CACHE_FLAG_TILES)) return 0;
+  uint32_t raster = flags >> 8 & 0xff, step = flags >> 16 & 0xff;
+  size_t levels = (raster >= 32 && step > 0 ? (raster - 32) / step + 1 : 0);
+  return sizeof(uint64_t) +
+    sizeof(uint64_t) * 3 * (levels * (levels + 1) * (2 * levels + 1) / 6);
 }
 
-void find_dup()
+static inline size_t cache_ent_extra(const cache_ent *e)
 {
-  srand(10);
-  for (size_t proj_id = 0; proj_id < N_PROJS; proj_id++) {
-    proj *p = (proj *)malloc(sizeof(proj) * n_records);
-    size_t *ppos = (size_t *)malloc(sizeof(size_t) * n_records);
-    projs[proj_id] = p;
-    proj_recpos[proj_id] = ppos;
-    // Projection
-    float wght[192];
-    for (int i = 0; i < 192; i++) wght[i] = randnorm();
-    for (size_t i = 0; i < n_records; i++) {
-      float val = 0;
-      for (int d = 0; d < 192; d++) {
-        int bit = (records[i].hash[d / 64] >> (d % 64)) & 1;
-        val += (bit ? wght[d] : 0);
-      }
-      p[i].record_id = i;
-      p[i].val = val;
+  return (e->flags & CACHE_FLAG_ORIENT ? CACHE_ORIENT_BYTES : 0) +
+    cache_tile_bytes(e->flags);
+}
+
+static inline bool cache_has_tiles(const cache_ent *e)
+{
+  return (e->flags & CACHE_FLAG_TILES) &&
+    (e->flags & CACHE_TILE_GEOM_MASK) == CACHE_TILE_GEOM;
+}
+
+static char *cache_buf = NULL;
+static size_t cache_n = 0;
+static size_t *cache_off;     // Offset of each cache_ent in cache_buf
+static size_t *cache_table;   // Entry index + 1, or 0 if the slot is empty
+static size_t cache_table_mask;
+
+static inline uint64_t str_hash(const char *s, size_t len)
+{
+  // FNV-1a
+  uint64_t h = 14695981039346656037ull;
+  for (size_t i = 0; i < len; i++) h = (h ^ (unsigned char)s[i]) * 1099511628211ull;
+  return h;
+}
+
+static inline cache_ent cache_entry(size_t i, const char **o_path)
+{
+  cache_ent e;
+  memcpy(&e, cache_buf + cache_off[i], sizeof e);
+  *o_path = cache_buf + cache_off[i] + sizeof e;
+  return e;
+}
+
+// Returns the index of the entry for `path`, or -1 if not present
+static ssize_t cache_find(const char *path)
+{
+  if (cache_n == 0) return -1;
+  size_t len = strlen(path);
+  for (size_t s = str_hash(path, len) & cache_table_mask; cache_table[s] != 0;
+      s = (s + 1) & cache_table_mask) {
+    const char *epath;
+    cache_ent e = cache_entry(cache_table[s] - 1, &epath);
+    if (e.path_len == len && memcmp(epath, path, len) == 0)
+      return cache_table[s] - 1;
+  }
+  return -1;
+}
+
+void cache_load(const char *path)
+{
+  FILE *fp = fopen(path, "rb");
+  if (fp == NULL) return;
+  fseek(fp, 0, SEEK_END);
+  long len = ftell(fp);
+  fseek(fp, 0, SEEK_SET);
+  cache_buf = (char *)malloc(len > 0 ? len : 1);
+  bool valid = (len >= (long)sizeof(cache_header) &&
+    fread(cache_buf, len, 1, fp) == 1);
+  fclose(fp);
+
+  cache_header hdr;
+  if (valid) {
+    memcpy(&hdr, cache_buf, sizeof hdr);
+    valid = (memcmp(hdr.magic, CACHE_MAGIC, sizeof hdr.magic) == 0 ||
+      memcmp(hdr.magic, CACHE_MAGIC_V2, sizeof hdr.magic) == 0);
+  }
+  if (valid) {
+    cache_off = (size_t *)malloc(sizeof(size_t) * (hdr.n > 0 ? hdr.n : 1));
+    size_t off = sizeof hdr;
+    for (uint64_t i = 0; i < hdr.n; i++) {
+      cache_ent e;
+      if (off + sizeof e > (size_t)len) { valid = false; break; }
+      memcpy(&e, cache_buf + off, sizeof e);
+      size_t ent_len = sizeof e + e.path_len + cache_ent_extra(&e);
+      if (off + ent_len > (size_t)len) { valid = false; break; }
+      cache_off[i] = off;
+      off += ent_len;
     }
-    qsort(p, n_records, sizeof(proj), proj_cmp);
-    for (size_t i = 0; i < n_records; i++)
-      ppos[p[i].record_id] = i;
   }
-  // Find duplicates
+  if (!valid) {
+    printf("Hash cache %s is corrupted or outdated, ignoring\n", path);
+    free(cache_buf);
+    cache_buf = NULL;
+    return;
+  }
+
+  cache_n = hdr.n;
+  size_t table_size = 16;
+  while (table_size < cache_n * 2) table_size *= 2;
+  cache_table_mask = table_size - 1;
+  cache_table = (size_t *)calloc(table_size, sizeof(size_t));
+  for (size_t i = 0; i < cache_n; i++) {
+    const char *epath;
+    cache_ent e = cache_entry(i, &epath);
+    size_t s = str_hash(epath, e.path_len) & cache_table_mask;
+    while (cache_table[s] != 0) s = (s + 1) & cache_table_mask;
+    cache_table[s] = i + 1;
+  }
+}
+
+// `o_extra` is as for hash_image()
+static bool cache_lookup(const char *path, record *r, uint64_t o_hash[3],
+  hash_set *o_extra)
+{
+  ssize_t i = cache_find(path);
+  if (i == -1) return false;
+  const char *epath;
+  cache_ent e = cache_entry(i, &epath);
+  bool want_orient = (dihedral && o_extra != NULL);
+  bool want_tiles = (tiled && o_extra != NULL);
+  if (e.size != r->size || e.mtime != r->mtime ||
+      (e.flags & CACHE_FLAG_REDUCED) != (reduced_decode ? CACHE_FLAG_REDUCED : 0) ||
+      (want_orient && !(e.flags & CACHE_FLAG_ORIENT)) ||
+      (want_tiles && !cache_has_tiles(&e)))
+    return false;
+  memcpy(o_hash, e.hash, sizeof e.hash);
+  const char *extra = epath + e.path_len;
+  if (e.flags & CACHE_FLAG_ORIENT) {
+    if (want_orient) {
+      memcpy(o_extra->var[0], e.hash, sizeof e.hash);
+      memcpy(o_extra->var[1], extra, CACHE_ORIENT_BYTES);
+    }
+    extra += CACHE_ORIENT_BYTES;
+  }
+  if (want_tiles) {
+    memcpy(&o_extra->tile_mask, extra, sizeof(uint64_t));
+    memcpy(o_extra->tile, extra + sizeof(uint64_t), sizeof o_extra->tile);
+  }
+  r->w = e.w;
+  r->h = e.h;
+  return true;
+}
+
+// Files are saved to "<path>.tmp" first and renamed over the destination
+static char *tmp_path_for(const char *path)
+{
+  size_t path_len = strlen(path);
+  char *tmp_path = (char *)malloc(path_len + 5);
+  memcpy(tmp_path, path, path_len);
+  memcpy(tmp_path + path_len, ".tmp", 5);
+  return tmp_path;
+}
+
+static cache_ent record_ent(size_t i, const char *name)
+{
+  const record *r = &records[i];
+  cache_ent e = {
+    .size = r->size, .mtime = r->mtime,
+    .w = r->w, .h = r->h,
+    .path_len = strlen(name),
+    .flags = (reduced_decode ? CACHE_FLAG_REDUCED : 0),
+  };
+  get_hash(i, e.hash);
+  return e;
+}
+
+// `extra` holds the cache_ent_extra(e) bytes that follow the path
+static bool cache_write_ent(FILE *fp, const cache_ent *e, const char *path,
+  const void *extra)
+{
+  return fwrite(e, sizeof *e, 1, fp) == 1 &&
+    (e->path_len == 0 || fwrite(path, e->path_len, 1, fp) == 1) &&
+    (cache_ent_extra(e) == 0 || fwrite(extra, cache_ent_extra(e), 1, fp) == 1);
+}
+
+// Writes all current records, plus previously cached entries for paths
+// not seen in this run, to a temporary file that then replaces `path`
+void cache_save(const char *path)
+{
+  bool *seen = (bool *)calloc(cache_n + 1, sizeof(bool));
+  size_t n_kept = 0;
   for (size_t i = 0; i < n_records; i++) {
-    // Find a project with the minimum number of candidates
-    size_t min_cand = n_records + 1;
-    size_t min_proj_id, min_jl, min_jr;
-    for (size_t proj_id = 0; proj_id < N_PROJS; proj_id++) {
-      size_t j = proj_recpos[proj_id][i];
-      float val = projs[proj_id][j].val;
-      size_t jl = projs_binsearch(projs[proj_id], val - RANGE);
-      size_t jr = projs_binsearch(projs[proj_id], val + RANGE);
-      if (min_cand > jr - jl) {
-        min_cand = jr - jl;
-        min_proj_id = proj_id;
-        min_jl = jl;
-        min_jr = jr;
+    ssize_t j = cache_find(rec_name(i));
+    if (j != -1) seen[j] = true;
+  }
+  for (size_t i = 0; i < cache_n; i++) if (!seen[i]) n_kept++;
+
+  char *tmp_path = tmp_path_for(path);
+  FILE *fp = fopen(tmp_path, "wb");
+  if (fp == NULL) {
+    printf("Cannot save hash cache to %s\n", tmp_path);
+    free(tmp_path);
+    free(seen);
+    return;
+  }
+
+  cache_header hdr = {.n = n_records + n_kept};
+  memcpy(hdr.magic, CACHE_MAGIC, sizeof hdr.magic);
+  bool ok = (fwrite(&hdr, sizeof hdr, 1, fp) == 1);
+  for (size_t i = 0; ok && i < n_records; i++) {
+    const char *name = rec_name(i);
+    cache_ent e = record_ent(i, name);
+    // Orientations and tiles hashed in this run are written, and otherwise
+    // those of the old entry are kept while it is still valid
+    const char *old_extra = NULL;
+    cache_ent old;
+    ssize_t j = cache_find(name);
+    if (j != -1) {
+      const char *epath;
+      old = cache_entry(j, &epath);
+      if (old.size == e.size && old.mtime == e.mtime &&
+          (old.flags & CACHE_FLAG_REDUCED) == (e.flags & CACHE_FLAG_REDUCED))
+        old_extra = epath + old.path_len;
+    }
+    unsigned char extra[CACHE_ORIENT_BYTES + CACHE_TILE_BYTES];
+    size_t len = 0;
+    if (dihedral) {
+      e.flags |= CACHE_FLAG_ORIENT;
+      for (int v = 1; v < N_ORIENT; v++, len += sizeof(uint64_t) * 3) {
+        uint64_t h[3];
+        get_var(i, v, h);
+        memcpy(extra + len, h, sizeof h);
       }
+    } else if (old_extra != NULL && (old.flags & CACHE_FLAG_ORIENT)) {
+      e.flags |= CACHE_FLAG_ORIENT;
+      memcpy(extra, old_extra, CACHE_ORIENT_BYTES);
+      len += CACHE_ORIENT_BYTES;
     }
-    for (size_t j = min_jl; j < min_jr; j++)
-      if (j != proj_recpos[min_proj_id][i]) {
-        size_t k = projs[min_proj_id][j].record_id;
-        if (i > k) continue;
-        int dist =
-          __builtin_popcountll(records[i].hash[0] ^ records[k].hash[0]) +
-          __builtin_popcountll(records[i].hash[1] ^ records[k].hash[1]) +
-          __builtin_popcountll(records[i].hash[2] ^ records[k].hash[2]);
-        if (dist <= DIST_LIMIT)
-          printf("%2d -- %s %s\n", dist, records[i].name, records[k].name);
+    if (tiled) {
+      e.flags |= CACHE_FLAG_TILES | CACHE_TILE_GEOM;
+      memcpy(extra + len, &tile_masks[i], sizeof(uint64_t));
+      len += sizeof(uint64_t);
+      for (int a = 0; a < N_TILES; a++, len += sizeof(uint64_t) * 3) {
+        uint64_t h[3];
+        get_tile(i, a, h);
+        memcpy(extra + len, h, sizeof h);
       }
+    } else if (old_extra != NULL && cache_has_tiles(&old)) {
+      e.flags |= CACHE_FLAG_TILES | CACHE_TILE_GEOM;
+      memcpy(extra + len,
+        old_extra + (old.flags & CACHE_FLAG_ORIENT ? CACHE_ORIENT_BYTES : 0),
+        CACHE_TILE_BYTES);
+    }
+    ok = cache_write_ent(fp, &e, name, extra);
   }
+  for (size_t i = 0; ok && i < cache_n; i++) if (!seen[i]) {
+    const char *epath;
+    cache_ent e = cache_entry(i, &epath);
+    ok = cache_write_ent(fp, &e, epath, epath + e.path_len);
+  }
+  ok = (fclose(fp) == 0) && ok;
+  if (!ok || rename(tmp_path, path) != 0) {
+    printf("Cannot save hash cache to %s\n", path);
+    remove(tmp_path);
+  }
+  free(tmp_path);
+  free(seen);
 }
 
-int main(int argc, char *argv[])
+// Fills in the hashes and metadata of `r` (all but the name),
+// from the cache if the file is unchanged, otherwise by decoding it;
+// `o_extra` is as for hash_image()
+// Returns false if the image cannot be read
+bool fill_record(const char *path, record *r, uint64_t o_hash[3],
+  hash_set *o_extra, bool *o_cached)
+{
+  *o_cached = false;
+  struct stat st;
+  if (stat(path, &st) != 0) return false;
+  r->size = st.st_size;
+  r->mtime = st.st_mtime;
+  if (cache_lookup(path, r, o_hash, o_extra)) {
+    *o_cached = true;
+    return true;
+  }
+  return hash_image(path, o_hash, o_extra, &r->w, &r->h);
+}
+
+// Records the arrays are reserved for (see record_cap())
+size_t max_records = 0;
+
+// Rows are addressed by uint32_t ids, record i's being i * rows_per_rec + a,
+// and the gathers in hamming.c take them as signed, so the number of records
+// is capped such that every id of the widest row set stays below 2^31
+static size_t record_cap()
+{
+  size_t rows = 1;
+  if (dihedral && N_ORIENT > rows) rows = N_ORIENT;
+  if (tiled && N_TILES > rows) rows = N_TILES;
+  size_t cap = ((size_t)1 << 31) / rows;
+  return (cap < MAX_RECORDS ? cap : MAX_RECORDS);
+}
+
+// Reserves hash rows for `rows_per_rec` rows per record; being page-aligned,
+// they are 64-byte aligned
+static void reserve_rows(uint64_t *h[3], size_t rows_per_rec)
+{
+  for (int t = 0; t < 3; t++)
+    h[t] = (uint64_t *)vm_reserve(sizeof(uint64_t) * max_records * rows_per_rec);
+}
+
+// Makes the first `n_rows` hash rows usable
+static void commit_rows(uint64_t *h[3], size_t n_rows)
+{
+  for (int t = 0; t < 3; t++) vm_commit(h[t], sizeof(uint64_t) * n_rows);
+}
+
+// Adds a record for the `name_len` bytes at `name`, copied
+// `extra` holds the hashes enabled by -o and -t, if any
+void add_record(const char *name, size_t name_len, const record *r,
+  const uint64_t hash[3], const hash_set *extra)
 {
-  if (argc > 1) {
-    for (int i = 1; i < argc; i++) {
-      printf("(%d/%d) ", i, argc - 1);
-      process(argv[i]);
+  if (n_records >= cap_records) {
+    if (cap_records == 0) max_records = record_cap();
+    if (n_records >= max_records) {
+      printf("Too many images, at most %zu are supported\n", max_records);
+      exit(1);
+    }
+    if (cap_records == 0) {
+      records = (record *)vm_reserve(sizeof(record) * max_records);
+      reserve_rows(hashes, 1);
+      if (dihedral) reserve_rows(var_hashes, N_ORIENT);
+      if (tiled) {
+        reserve_rows(tile_hashes, N_TILES);
+        tile_masks = (uint64_t *)vm_reserve(sizeof(uint64_t) * max_records);
+      }
+    }
+    size_t new_cap = (cap_records == 0 ? 1024 : (cap_records * 2));
+    if (new_cap > max_records) new_cap = max_records;
+    vm_commit(records, sizeof(record) * new_cap);
+    commit_rows(hashes, new_cap);
+    if (removed != NULL) removed = (uint8_t *)realloc(removed, new_cap);
+    if (dihedral) commit_rows(var_hashes, new_cap * N_ORIENT);
+    if (tiled) {
+      commit_rows(tile_hashes, new_cap * N_TILES);
+      vm_commit(tile_masks, sizeof(uint64_t) * new_cap);
+    }
+    cap_records = new_cap;
+  }
+  records[n_records] = *r;
+  if (removed != NULL) removed[n_records] = 0;
+  for (int t = 0; t < 3; t++) hashes[t][n_records] = hash[t];
+  if (dihedral)
+    for (int v = 0; v < N_ORIENT; v++)
+      for (int t = 0; t < 3; t++)
+        var_hashes[t][n_records * N_ORIENT + v] = extra->var[v][t];
+  if (tiled) {
+    for (int a = 0; a < N_TILES; a++)
+      for (int t = 0; t < 3; t++)
+        tile_hashes[t][n_records * N_TILES + a] = extra->tile[a][t];
+    tile_masks[n_records] = extra->tile_mask;
+  }
+  if (names_fp != NULL) {
+    if (n_records % 1024 == 0)
+      name_off = (uint64_t *)realloc(name_off, sizeof(uint64_t) * (n_records + 1024));
+    if (fwrite(name, name_len, 1, names_fp) != 1 || fputc('\0', names_fp) == EOF) {
+      printf("Cannot spill names\n");
+      exit(1);
     }
+    name_off[n_records] = names_len;
+    names_len += name_len + 1;
+    records[n_records].name = 0;
   } else {
-    char path[1024];
-    while (fgets(path, sizeof path, stdin) != NULL) {
-      size_t len = strlen(path);
-      while (len > 0 && isspace(path[len - 1])) len--;
-      path[len] = '\0';
-      process(path);
+    records[n_records].name = name_add(name, name_len);
+  }
+  n_records++;
+}
+
+// Per-image progress goes here; stderr when stdout is to be machine-read
+FILE *log_fp;
+
+void process(const char *path)
+{
+  fprintf(log_fp, "Processing %s", path);
+  record r;
+  uint64_t hash[3];
+  hash_set extra;
+  bool cached;
+  if (!fill_record(path, &r, hash, &extra, &cached)) {
+    fprintf(log_fp, " -- Cannot open! Ignoring > <\n");
+    return;
+  }
+  fprintf(log_fp, " (%dx%d%s)\n", r.w, r.h, cached ? ", cached" : "");
+  add_record(path, strlen(path), &r, hash, &extra);
+}
+
+// Parallel ingestion
+// The main thread feeds paths into a bounded queue, workers decode and hash
+// into their own buffers, and a reporter thread owns the progress line.
+// Jobs are numbered in input order and each worker takes them in increasing
+// order, so every buffer is sorted and a k-way merge restores input order.
+
+#define JOBQ_CAP 256
+typedef struct job {
+  size_t id;
+  char *path;
+} job;
+typedef struct hashed {
+  size_t id;
+  char *path;
+  record rec;
+  uint64_t hash[3];
+  hash_set *extra;  // With -o or -t only
+  bool ok;
+} hashed;
+typedef struct worker {
+  pthread_t thread;
+  hashed *out;
+  size_t n_out, cap_out;
+} worker;
+
+static struct {
+  pthread_mutex_t lock;
+  pthread_cond_t not_empty, not_full, progress;
+  job q[JOBQ_CAP];
+  size_t head, count;
+  bool closed;    // No more jobs will be pushed
+  bool finished;  // All workers have exited
+  size_t n_queued, n_done, n_cached, n_failed;
+} jobq = {
+  .lock = PTHREAD_MUTEX_INITIALIZER,
+  .not_empty = PTHREAD_COND_INITIALIZER,
+  .not_full = PTHREAD_COND_INITIALIZER,
+  .progress = PTHREAD_COND_INITIALIZER,
+};
+
+static void jobq_push(char *path)
+{
+  pthread_mutex_lock(&jobq.lock);
+  while (jobq.count == JOBQ_CAP)
+    pthread_cond_wait(&jobq.not_full, &jobq.lock);
+  jobq.q[(jobq.head + jobq.count) % JOBQ_CAP] =
+    (job){.id = jobq.n_queued++, .path = path};
+  jobq.count++;
+  pthread_cond_signal(&jobq.not_empty);
+  pthread_mutex_unlock(&jobq.lock);
+}
+
+static void jobq_close()
+{
+  pthread_mutex_lock(&jobq.lock);
+  jobq.closed = true;
+  pthread_cond_broadcast(&jobq.not_empty);
+  pthread_mutex_unlock(&jobq.lock);
+}
+
+static void *worker_fn(void *arg)
+{
+  worker *wk = (worker *)arg;
+  while (true) {
+    pthread_mutex_lock(&jobq.lock);
+    while (jobq.count == 0 && !jobq.closed)
+      pthread_cond_wait(&jobq.not_empty, &jobq.lock);
+    if (jobq.count == 0) {
+      pthread_mutex_unlock(&jobq.lock);
+      break;
     }
+    job j = jobq.q[jobq.head];
+    jobq.head = (jobq.head + 1) % JOBQ_CAP;
+    jobq.count--;
+    pthread_cond_signal(&jobq.not_full);
+    pthread_mutex_unlock(&jobq.lock);
+
+    if (wk->n_out >= wk->cap_out) {
+      wk->cap_out = (wk->cap_out == 0 ? 32 : (wk->cap_out * 2));
+      wk->out = (hashed *)realloc(wk->out, sizeof(hashed) * wk->cap_out);
+    }
+    hashed *hd = &wk->out[wk->n_out++];
+    bool cached;
+    hd->id = j.id;
+    hd->extra = (dihedral || tiled ? (hash_set *)malloc(sizeof(hash_set)) : NULL);
+    hd->ok = fill_record(j.path, &hd->rec, hd->hash, hd->extra, &cached);
+    hd->path = j.path;
+
+    pthread_mutex_lock(&jobq.lock);
+    jobq.n_done++;
+    if (cached) jobq.n_cached++;
+    if (!hd->ok) jobq.n_failed++;
+    pthread_mutex_unlock(&jobq.lock);
+  }
+  return NULL;
+}
+
+static void *reporter_fn(void *arg)
+{
+  (void)arg;
+  pthread_mutex_lock(&jobq.lock);
+  while (true) {
+    fprintf(stderr, "\rHashed %zu/%zu%s, %zu cached, %zu failed",
+      jobq.n_done, jobq.n_queued, jobq.closed ? "" : "+",
+      jobq.n_cached, jobq.n_failed);
+    if (jobq.finished) break;
+    struct timeval now;
+    gettimeofday(&now, NULL);
+    struct timespec until = {
+      .tv_sec = now.tv_sec + (now.tv_usec >= 800000),
+      .tv_nsec = (now.tv_usec + 200000) % 1000000 * 1000,
+    };
+    pthread_cond_timedwait(&jobq.progress, &jobq.lock, &until);
+  }
+  pthread_mutex_unlock(&jobq.lock);
+  fprintf(stderr, "\n");
+  return NULL;
+}
+
+static bool index_has(const char *path);
+size_t query_k = 0;  // Neighbours per query image (-q), 0 for the pair search
+int query_within = 192;  // Farthest neighbour distance for queries (--within)
+
+// Returns the next input path, or NULL at the end of input
+// Paths come from the command line if any are given, otherwise from stdin
+// Paths already present in a loaded index are skipped, except for queries
+static char **arg_paths;
+static int n_arg_paths, arg_pos = 0;
+static const char *next_path(char *buf, size_t size)
+{
+  const char *path;
+  do {
+    if (arg_paths != NULL) {
+      if (arg_pos >= n_arg_paths) return NULL;
+      path = arg_paths[arg_pos++];
+    } else {
+      if (fgets(buf, size, stdin) == NULL) return NULL;
+      size_t len = strlen(buf);
+      while (len > 0 && isspace(buf[len - 1])) len--;
+      buf[len] = '\0';
+      path = buf;
+    }
+  } while (query_k == 0 && index_has(path));
+  return path;
+}
+
+void process_parallel()
+{
+  worker *workers = (worker *)calloc(n_threads, sizeof(worker));
+  for (int i = 0; i < n_threads; i++)
+    pthread_create(&workers[i].thread, NULL, worker_fn, &workers[i]);
+  pthread_t reporter;
+  pthread_create(&reporter, NULL, reporter_fn, NULL);
+
+  char buf[1024];
+  const char *path;
+  while ((path = next_path(buf, sizeof buf)) != NULL)
+    jobq_push(strdup(path));
+  jobq_close();
+
+  for (int i = 0; i < n_threads; i++)
+    pthread_join(workers[i].thread, NULL);
+  pthread_mutex_lock(&jobq.lock);
+  jobq.finished = true;
+  pthread_cond_signal(&jobq.progress);
+  pthread_mutex_unlock(&jobq.lock);
+  pthread_join(reporter, NULL);
+
+  // Merge in input order
+  size_t *pos = (size_t *)calloc(n_threads, sizeof(size_t));
+  for (size_t id = 0; id < jobq.n_queued; id++) {
+    hashed *hd = NULL;
+    for (int i = 0; i < n_threads; i++)
+      if (pos[i] < workers[i].n_out && workers[i].out[pos[i]].id == id) {
+        hd = &workers[i].out[pos[i]++];
+        break;
+      }
+    if (hd->ok)
+      add_record(hd->path, strlen(hd->path), &hd->rec, hd->hash, hd->extra);
+    else
+      fprintf(log_fp, "Cannot open %s! Ignoring > <\n", hd->path);
+    free(hd->path);
+    free(hd->extra);
+  }
+  free(pos);
+  for (int i = 0; i < n_threads; i++) free(workers[i].out);
+  free(workers);
+}
+
+// Duplicate search
+// Pairs within DIST_LIMIT bits (over all 192 hash bits) are reported
+
+// Tuning parameters below can be overridden with -D (see bench.sh)
+#ifndef DIST_LIMIT
+#define DIST_LIMIT 30
+#endif
+// Candidates are scored by hamming_batch() in runs of at most this many
+#define VERIFY_BATCH 256
+
+// Clustering
+// Instead of printing pairs, accepted pairs can be merged with union-find,
+// and each resulting group printed as one line: the representative (largest
+// resolution, then largest file, then earliest in the input) followed by the
+// other members in input order, all separated by tabs.
+
+bool cluster_mode = false;
+static uint32_t *uf_parent = NULL;
+
+static uint32_t uf_find(uint32_t x)
+{
+  while (uf_parent[x] != x) {
+    uf_parent[x] = uf_parent[uf_parent[x]];
+    x = uf_parent[x];
+  }
+  return x;
+}
+
+static void uf_union(uint32_t a, uint32_t b)
+{
+  a = uf_find(a);
+  b = uf_find(b);
+  // The smaller id becomes the root, so roots are the first members
+  if (a < b) uf_parent[b] = a;
+  else if (b < a) uf_parent[a] = b;
+}
+
+static size_t n_pairs = 0;
+
+typedef struct pair_ent {
+  uint32_t i, k;
+  uint32_t dist;
+} pair_ent;
+
+static void report_pair(size_t i, size_t k, int dist)
+{
+  n_pairs++;
+  if (cluster_mode) {
+    if (uf_parent == NULL) {
+      uf_parent = (uint32_t *)malloc(sizeof(uint32_t) * n_records);
+      for (size_t j = 0; j < n_records; j++) uf_parent[j] = j;
+    }
+    uf_union(i, k);
+  } else {
+    // Separate calls, as rec_name() may reuse its buffer
+    printf("%2d -- %s", dist, rec_name(i));
+    printf(" %s\n", rec_name(k));
+  }
+}
+
+static inline bool better_representative(size_t a, size_t b)
+{
+  uint64_t area_a = (uint64_t)records[a].w * records[a].h;
+  uint64_t area_b = (uint64_t)records[b].w * records[b].h;
+  if (area_a != area_b) return area_a > area_b;
+  if (records[a].size != records[b].size) return records[a].size > records[b].size;
+  return a < b;
+}
+
+void print_clusters()
+{
+  if (uf_parent == NULL) return;
+  // Chain the members of each cluster in input order, headed by the root
+  uint32_t *next = (uint32_t *)malloc(sizeof(uint32_t) * n_records);
+  uint32_t *tail = (uint32_t *)malloc(sizeof(uint32_t) * n_records);
+  uint32_t *rep = (uint32_t *)malloc(sizeof(uint32_t) * n_records);
+  for (size_t i = 0; i < n_records; i++) {
+    uint32_t r = uf_find(i);
+    next[i] = (uint32_t)-1;
+    if (r == i) {
+      tail[i] = rep[i] = i;
+    } else {
+      next[tail[r]] = i;
+      tail[r] = i;
+      if (better_representative(i, rep[r])) rep[r] = i;
+    }
+  }
+  for (size_t i = 0; i < n_records; i++) {
+    if (uf_parent[i] != i || next[i] == (uint32_t)-1) continue;
+    printf("%s", rec_name(rep[i]));
+    for (uint32_t j = i; j != (uint32_t)-1; j = next[j])
+      if (j != rep[i]) printf("\t%s", rec_name(j));
+    printf("\n");
+  }
+  free(next);
+  free(tail);
+  free(rep);
+}
+
+// Parallel verification
+// Once the index is built, records are looked up in chunks of VERIFY_CHUNK
+// ids, which the threads (-j) take in turn. Each chunk writes its pairs to
+// its own buffer, as output lines, or as pairs to merge with -C, and the
+// main thread replays the buffers in chunk order, so the output is the same
+// as a serial run's. Threads run at most VERIFY_WINDOW chunks per thread
+// ahead of the replay, which bounds the memory held in buffers.
+
+#define VERIFY_CHUNK 256
+#define VERIFY_WINDOW 4
+
+typedef struct verify_buf {
+  char *text;
+  size_t len_text, cap_text;
+  pair_ent *pairs;
+  size_t n_pairs, cap_pairs;
+} verify_buf;
+
+typedef struct match {
+  uint32_t id;
+  int dist;
+} match;
+
+// Per-thread scratch for the lookups
+typedef struct verify_scratch {
+  size_t first;  // As for find_dup_mih()
+  uint32_t *stamp;
+  match *matches;
+  size_t cap_matches;
+  uint64_t *votes;
+  size_t cap_votes;
+} verify_scratch;
+
+typedef void (*verify_fn)(size_t i, verify_scratch *s, verify_buf *out);
+
+// Adds pair (i, k) to a chunk's output
+static void verify_out(verify_buf *b, size_t i, size_t k, int dist)
+{
+  if (cluster_mode) {
+    if (b->n_pairs == b->cap_pairs) {
+      b->cap_pairs = (b->cap_pairs == 0 ? 64 : b->cap_pairs * 2);
+      b->pairs = (pair_ent *)realloc(b->pairs, sizeof(pair_ent) * b->cap_pairs);
+    }
+    b->pairs[b->n_pairs++] = (pair_ent){ .i = i, .k = k, .dist = dist };
+    return;
+  }
+  // Separate calls, as rec_name() may reuse its buffer
+  for (int part = 0; part < 2; part++) {
+    const char *name = rec_name(part == 0 ? i : k);
+    size_t need = strlen(name) + 8;
+    if (b->len_text + need > b->cap_text) {
+      while (b->len_text + need > b->cap_text)
+        b->cap_text = (b->cap_text == 0 ? 4096 : b->cap_text * 2);
+      b->text = (char *)realloc(b->text, b->cap_text);
+    }
+    b->len_text += (part == 0 ?
+      sprintf(b->text + b->len_text, "%2d -- %s", dist, name) :
+      sprintf(b->text + b->len_text, " %s\n", name));
+  }
+  b->n_pairs++;
+}
+
+// Reports the pairs in a chunk's output and empties it
+static void verify_replay(verify_buf *b)
+{
+  if (cluster_mode) {
+    for (size_t j = 0; j < b->n_pairs; j++)
+      report_pair(b->pairs[j].i, b->pairs[j].k, b->pairs[j].dist);
+  } else {
+    n_pairs += b->n_pairs;
+    fwrite(b->text, 1, b->len_text, stdout);
+  }
+  b->len_text = b->n_pairs = 0;
+}
+
+static struct {
+  verify_fn fn;
+  size_t first, n_chunks;
+  size_t next_chunk;  // Next chunk to be taken
+  size_t next_out;    // Next chunk to be replayed
+  size_t window;
+  verify_buf *bufs;   // Chunk c in bufs[c % window]
+  bool *done;
+  pthread_mutex_t lock;
+  pthread_cond_t cond;
+} vq = { .lock = PTHREAD_MUTEX_INITIALIZER, .cond = PTHREAD_COND_INITIALIZER };
+
+static void verify_chunk(size_t c, verify_scratch *s, verify_buf *out)
+{
+  size_t lo = vq.first + c * VERIFY_CHUNK;
+  size_t hi = (n_records - lo < VERIFY_CHUNK ? n_records : lo + VERIFY_CHUNK);
+  for (size_t i = lo; i < hi; i++) vq.fn(i, s, out);
+}
+
+static void scratch_init(verify_scratch *s)
+{
+  *s = (verify_scratch){ .first = vq.first };
+  s->stamp = (uint32_t *)calloc(n_records + 1, sizeof(uint32_t));
+}
+
+static void scratch_free(verify_scratch *s)
+{
+  free(s->stamp);
+  free(s->matches);
+  free(s->votes);
+}
+
+static void *verify_worker(void *arg)
+{
+  (void)arg;
+  verify_scratch s;
+  scratch_init(&s);
+  pthread_mutex_lock(&vq.lock);
+  while (true) {
+    while (vq.next_chunk < vq.n_chunks && vq.next_chunk >= vq.next_out + vq.window)
+      pthread_cond_wait(&vq.cond, &vq.lock);
+    if (vq.next_chunk >= vq.n_chunks) break;
+    size_t c = vq.next_chunk++;
+    pthread_mutex_unlock(&vq.lock);
+    verify_chunk(c, &s, &vq.bufs[c % vq.window]);
+    pthread_mutex_lock(&vq.lock);
+    vq.done[c % vq.window] = true;
+    pthread_cond_broadcast(&vq.cond);
+  }
+  pthread_mutex_unlock(&vq.lock);
+  scratch_free(&s);
+  return NULL;
+}
+
+// Runs `fn` for every record in [first, n_records), reporting the pairs
+// it outputs in record order
+static void verify_all(size_t first, verify_fn fn)
+{
+  vq.fn = fn;
+  vq.first = first;
+  vq.n_chunks = (n_records - first + VERIFY_CHUNK - 1) / VERIFY_CHUNK;
+  if (n_threads <= 1 || vq.n_chunks <= 1) {
+    verify_scratch s;
+    verify_buf b = { 0 };
+    scratch_init(&s);
+    for (size_t c = 0; c < vq.n_chunks; c++) {
+      verify_chunk(c, &s, &b);
+      verify_replay(&b);
+    }
+    scratch_free(&s);
+    free(b.text);
+    free(b.pairs);
+    return;
+  }
+
+  vq.next_chunk = vq.next_out = 0;
+  vq.window = (size_t)n_threads * VERIFY_WINDOW;
+  vq.bufs = (verify_buf *)calloc(vq.window, sizeof(verify_buf));
+  vq.done = (bool *)calloc(vq.window, sizeof(bool));
+  pthread_t *threads = (pthread_t *)malloc(sizeof(pthread_t) * n_threads);
+  for (int t = 0; t < n_threads; t++)
+    pthread_create(&threads[t], NULL, verify_worker, NULL);
+  pthread_mutex_lock(&vq.lock);
+  while (vq.next_out < vq.n_chunks) {
+    size_t slot = vq.next_out % vq.window;
+    while (!vq.done[slot]) pthread_cond_wait(&vq.cond, &vq.lock);
+    pthread_mutex_unlock(&vq.lock);
+    verify_replay(&vq.bufs[slot]);
+    pthread_mutex_lock(&vq.lock);
+    vq.done[slot] = false;
+    vq.next_out++;
+    pthread_cond_broadcast(&vq.cond);
+  }
+  pthread_mutex_unlock(&vq.lock);
+  for (int t = 0; t < n_threads; t++) pthread_join(threads[t], NULL);
+  for (size_t j = 0; j < vq.window; j++) {
+    free(vq.bufs[j].text);
+    free(vq.bufs[j].pairs);
+  }
+  free(vq.bufs);
+  free(vq.done);
+  free(threads);
+}
+
+// Random projections (approximate; kept for comparison, see --lsh)
+// Each hash is projected onto N_PROJS random directions, and candidates
+// for a record are taken from the projection where its RANGE-neighbourhood
+// is the smallest
+
+#ifndef N_PROJS
+#define N_PROJS 300
+#endif
+#ifndef RANGE
+#define RANGE (DIST_LIMIT / 2)
+#endif
+typedef struct proj {
+  size_t record_id;
+  float val;
+} proj;
+proj *projs[N_PROJS];
+size_t *proj_recpos[N_PROJS];
+
+int proj_cmp(const void *_a, const void *_b)
+{
+  proj *a = (proj *)_a;
+  proj *b = (proj *)_b;
+  return (a->val < b->val ? -1 : a->val > b->val ? 1 : 0);
+}
+
+size_t projs_binsearch(const proj *p, float val)
+{
+  ssize_t l = -1, r = n_records;
+  while (l < r - 1) {
+    size_t m = (l + r) / 2;
+    if (p[m].val >= val) r = m; else l = m;
+  }
+  return r;
+}
+
+static inline float randuniform()
+{
+  return (float)rand() / RAND_MAX;
+}
+static inline float randnorm()
+{
+  float u = randuniform();
+  float v = randuniform();
+  return sqrtf(-2 * logf(u)) * cosf((float)M_PI * 2 * v);
+}
+
+static float proj_wght[N_PROJS][192];
+
+// Projects all records onto direction `proj_id` and sorts them
+// The projection is bit-sliced: for each of the 24 hash bytes, a table gives
+// the sum of the weights of the set bits for all 256 byte values, so each
+// record costs 24 lookups instead of 192 conditional adds
+static void project(size_t proj_id)
+{
+  static _Thread_local float lut[24][256];
+  const float *wght = proj_wght[proj_id];
+  for (int b = 0; b < 24; b++) {
+    lut[b][0] = 0;
+    for (int v = 1; v < 256; v++) {
+      // Bits are added from low to high, as in a bit-by-bit sum
+      int top = 31 - __builtin_clz(v);
+      lut[b][v] = lut[b][v & ~(1 << top)] + wght[b * 8 + top];
+    }
+  }
+
+  proj *p = (proj *)malloc(sizeof(proj) * n_records);
+  size_t *ppos = (size_t *)malloc(sizeof(size_t) * n_records);
+  for (size_t i = 0; i < n_records; i++) {
+    float val = 0;
+    for (int t = 0; t < 3; t++) {
+      uint64_t word = hashes[t][i];
+      for (int b = 0; b < 8; b++)
+        val += lut[t * 8 + b][(word >> (b * 8)) & 0xff];
+    }
+    p[i].record_id = i;
+    p[i].val = val;
+  }
+  qsort(p, n_records, sizeof(proj), proj_cmp);
+  for (size_t i = 0; i < n_records; i++)
+    ppos[p[i].record_id] = i;
+  projs[proj_id] = p;
+  proj_recpos[proj_id] = ppos;
+}
+
+static void *project_worker(void *arg)
+{
+  // Thread t takes projections t, t + n_threads, ...
+  for (size_t proj_id = (size_t)arg; proj_id < N_PROJS; proj_id += n_threads)
+    project(proj_id);
+  return NULL;
+}
+
+// Looks up record i in the projection with the fewest candidates
+static void lsh_verify(size_t i, verify_scratch *s, verify_buf *out)
+{
+  (void)s;
+  size_t min_cand = n_records + 1;
+  size_t min_proj_id = 0, min_jl = 0, min_jr = 0;
+  for (size_t proj_id = 0; proj_id < N_PROJS; proj_id++) {
+    size_t j = proj_recpos[proj_id][i];
+    float val = projs[proj_id][j].val;
+    size_t jl = projs_binsearch(projs[proj_id], val - RANGE);
+    size_t jr = projs_binsearch(projs[proj_id], val + RANGE);
+    if (min_cand > jr - jl) {
+      min_cand = jr - jl;
+      min_proj_id = proj_id;
+      min_jl = jl;
+      min_jr = jr;
+    }
+  }
+  // Verify candidates in batches
+  uint32_t cand_ids[VERIFY_BATCH];
+  uint8_t cand_dist[VERIFY_BATCH];
+  uint64_t hash[3];
+  get_hash(i, hash);
+  for (size_t j0 = min_jl; j0 < min_jr; j0 += VERIFY_BATCH) {
+    size_t n_batch = (min_jr - j0 < VERIFY_BATCH ? min_jr - j0 : VERIFY_BATCH);
+    for (size_t j = 0; j < n_batch; j++)
+      cand_ids[j] = projs[min_proj_id][j0 + j].record_id;
+    hamming_batch(hash, hashes, cand_ids, n_batch, cand_dist);
+    for (size_t j = 0; j < n_batch; j++) {
+      size_t k = cand_ids[j];
+      if (i >= k) continue;
+      if (cand_dist[j] <= DIST_LIMIT) verify_out(out, i, k, cand_dist[j]);
+    }
+  }
+}
+
+void find_dup_lsh()
+{
+  // Weights are drawn serially so that projections do not depend on -j
+  srand(10);
+  for (size_t proj_id = 0; proj_id < N_PROJS; proj_id++)
+    for (int i = 0; i < 192; i++) proj_wght[proj_id][i] = randnorm();
+  if (n_threads > 1) {
+    pthread_t *threads = (pthread_t *)malloc(sizeof(pthread_t) * n_threads);
+    for (int t = 0; t < n_threads; t++)
+      pthread_create(&threads[t], NULL, project_worker, (void *)(size_t)t);
+    for (int t = 0; t < n_threads; t++)
+      pthread_join(threads[t], NULL);
+    free(threads);
+  } else {
+    project_worker((void *)0);
+  }
+  verify_all(0, lsh_verify);
+}
+
+// Multi-index hashing (exact)
+// Norouzi et al., "Fast search in Hamming space with multi-index hashing"
+// The 192 bits are split into MIH_M substrings of MIH_BITS bits each.
+// If two hashes are within DIST_LIMIT, then by pigeonhole they differ in at
+// most MIH_R = DIST_LIMIT / MIH_M bits on at least one substring, so probing
+// every substring table with all keys within MIH_R of the query's substring
+// finds every such pair. Each table is a direct-addressed bucket array in
+// CSR form (bucket offsets + record ids sorted by substring value).
+
+#define MIH_M 12
+#define MIH_BITS 16
+#define MIH_R (DIST_LIMIT / MIH_M)
+_Static_assert(MIH_M * MIH_BITS == 192 && 64 % MIH_BITS == 0,
+  "substrings should evenly tile the three 64-bit words");
+
+static uint32_t *mih_start[MIH_M];  // (1 << MIH_BITS) + 1 bucket offsets each
+static uint32_t *mih_ids[MIH_M];
+static size_t mih_n = 0;            // Number of records in the tables
+static uint32_t *mih_masks = NULL;  // All flip masks with at most MIH_R bits
+static size_t n_mih_masks;
+
+static inline uint32_t mih_key(const uint64_t hash[3], int t)
+{
+  const int per_word = 64 / MIH_BITS;
+  return (hash[t / per_word] >> (t % per_word * MIH_BITS)) &
+    ((1u << MIH_BITS) - 1);
+}
+
+// With -o the tables hold one row per orientation of each record (row
+// i * N_ORIENT + v, as in var_hashes), so probing with a record's own hash
+// meets the other records in every orientation at once
+static inline size_t mih_rows_per_rec()
+{
+  return (dihedral ? N_ORIENT : 1);
+}
+
+static inline uint32_t row_key(uint64_t *const h[3], size_t row, int t)
+{
+  uint64_t hash[3] = {h[0][row], h[1][row], h[2][row]};
+  return mih_key(hash, t);
+}
+
+static inline uint32_t mih_key_of(size_t row, int t)
+{
+  return row_key(dihedral ? var_hashes : hashes, row, t);
+}
+
+static void mih_init_masks()
+{
+  if (mih_masks != NULL) return;
+  n_mih_masks = 0;
+  mih_masks = (uint32_t *)malloc(sizeof(uint32_t) << MIH_BITS);
+  for (uint32_t m = 0; m < (1u << MIH_BITS); m++)
+    if (__builtin_popcount(m) <= MIH_R) mih_masks[n_mih_masks++] = m;
+}
+
+static inline bool row_used(const uint64_t *masks, size_t rows_per_rec, size_t row)
+{
+  return masks == NULL || (masks[row / rows_per_rec] >> (row % rows_per_rec) & 1);
+}
+
+// Appends the rows of records [rec_lo, rec_hi) to table t in `*io_start` and
+// `*io_ids` (NULL when empty); record i has rows [i * rows_per_rec,
+// (i + 1) * rows_per_rec) in `h`, of which only those set in masks[i] are
+// added if `masks` is not NULL
+// Each bucket keeps its existing ids and gets the new ones appended, so
+// ids stay sorted within buckets; this is a counting sort when starting empty
+static void mih_build(uint32_t **io_start, uint32_t **io_ids, int t,
+  uint64_t *const h[3], size_t rows_per_rec, const uint64_t *masks,
+  size_t rec_lo, size_t rec_hi)
+{
+  uint32_t *old_start = *io_start;
+  uint32_t *old_ids = *io_ids;
+  size_t row_lo = rec_lo * rows_per_rec, row_hi = rec_hi * rows_per_rec;
+  uint32_t *start = (uint32_t *)calloc((1u << MIH_BITS) + 1, sizeof(uint32_t));
+  // Bucket sizes, then offsets
+  for (size_t i = row_lo; i < row_hi; i++)
+    if (row_used(masks, rows_per_rec, i)) start[row_key(h, i, t) + 1]++;
+  for (uint32_t b = 0; b < (1u << MIH_BITS); b++) {
+    if (old_start != NULL) start[b + 1] += old_start[b + 1] - old_start[b];
+    start[b + 1] += start[b];
+  }
+  uint32_t *ids = (uint32_t *)malloc(sizeof(uint32_t) * (start[1u << MIH_BITS] + 1));
+  // Old ids, then the new ones at the end of each bucket
+  uint32_t *fill = (uint32_t *)malloc(sizeof(uint32_t) << MIH_BITS);
+  for (uint32_t b = 0; b < (1u << MIH_BITS); b++) {
+    uint32_t n_old = (old_start != NULL ? old_start[b + 1] - old_start[b] : 0);
+    if (n_old > 0)
+      memcpy(ids + start[b], old_ids + old_start[b], sizeof(uint32_t) * n_old);
+    fill[b] = start[b] + n_old;
+  }
+  for (size_t i = row_lo; i < row_hi; i++)
+    if (row_used(masks, rows_per_rec, i)) ids[fill[row_key(h, i, t)]++] = i;
+  free(fill);
+  free(old_start);
+  free(old_ids);
+  *io_start = start;
+  *io_ids = ids;
+}
+
+// Adds records [mih_n, n_records) to table t
+static void mih_insert_table(int t)
+{
+  mih_build(&mih_start[t], &mih_ids[t], t, dihedral ? var_hashes : hashes,
+    mih_rows_per_rec(), NULL, mih_n, n_records);
+}
+
+// Adds records [mih_n, n_records) to the tables
+void mih_insert()
+{
+  mih_init_masks();
+  for (int t = 0; t < MIH_M; t++) mih_insert_table(t);
+  mih_n = n_records;
+}
+
+static int match_cmp(const void *_a, const void *_b)
+{
+  const match *a = (const match *)_a;
+  const match *b = (const match *)_b;
+  return (a->id < b->id ? -1 : a->id > b->id ? 1 : 0);
+}
+
+static inline void push_match(match **o_matches, size_t *cap_matches,
+  size_t *n_matches, uint32_t id, int dist)
+{
+  if (*n_matches >= *cap_matches) {
+    *cap_matches = (*cap_matches == 0 ? 32 : (*cap_matches * 2));
+    *o_matches = (match *)realloc(*o_matches, sizeof(match) * *cap_matches);
+  }
+  (*o_matches)[(*n_matches)++] = (match){.id = id, .dist = dist};
+}
+
+// Collects all records within DIST_LIMIT of `hash`, sorted by id, except
+// those with ids in [skip_lo, skip_hi]; `stamp` holds one entry per record,
+// with values distinct from `stamp_val` (which marks records already
+// examined for this query)
+// Returns the number of matches written to `*o_matches` (grown as needed)
+size_t mih_query(const uint64_t hash[3], size_t skip_lo, size_t skip_hi,
+  uint32_t *stamp, uint32_t stamp_val,
+  match **o_matches, size_t *cap_matches)
+{
+  size_t n_matches = 0;
+  for (int t = 0; t < MIH_M; t++) {
+    uint32_t key = mih_key(hash, t);
+    for (size_t m = 0; m < n_mih_masks; m++) {
+      uint32_t b = key ^ mih_masks[m];
+      for (uint32_t p0 = mih_start[t][b]; p0 < mih_start[t][b + 1]; p0 += VERIFY_BATCH) {
+        uint32_t n_batch = mih_start[t][b + 1] - p0;
+        if (n_batch > VERIFY_BATCH) n_batch = VERIFY_BATCH;
+        const uint32_t *cand_ids = mih_ids[t] + p0;
+        uint8_t cand_dist[VERIFY_BATCH];
+        hamming_batch(hash, dihedral ? var_hashes : hashes, cand_ids, n_batch, cand_dist);
+        for (uint32_t j = 0; j < n_batch; j++) {
+          uint32_t k = cand_ids[j] / mih_rows_per_rec();
+          if (cand_dist[j] > DIST_LIMIT || (k >= skip_lo && k <= skip_hi) ||
+              stamp[k] == stamp_val)
+            continue;
+          stamp[k] = stamp_val;
+          int dist = cand_dist[j];
+          if (dihedral) {
+            // The nearest orientation, which may sit in another bucket
+            uint32_t rows[N_ORIENT];
+            uint8_t rows_dist[N_ORIENT];
+            for (int v = 0; v < N_ORIENT; v++) rows[v] = k * N_ORIENT + v;
+            hamming_batch(hash, var_hashes, rows, N_ORIENT, rows_dist);
+            for (int v = 0; v < N_ORIENT; v++)
+              if (rows_dist[v] < dist) dist = rows_dist[v];
+          }
+          push_match(o_matches, cap_matches, &n_matches, k, dist);
+        }
+      }
+    }
+  }
+  qsort(*o_matches, n_matches, sizeof(match), match_cmp);
+  return n_matches;
+}
+
+// Tile matches (-t)
+// The tiles of all records go into a second set of substring tables. Each
+// tile of record i is looked up there, and each tile of a later record
+// within TILE_DIST of it casts a vote for the scale and offset that map one
+// window onto the other: the pair of levels, and the difference of window
+// positions. Record k matches record i if at least TILE_MIN_AGREE tiles of
+// i vote for the same scale and offset with it, and the other overlapping
+// tiles under that scale and offset are close too: windows of unrelated
+// images agree now and then, but seldom all over the overlap.
+
+// Tiles are probed within TILE_MIH_R bits per substring, so votes are cast
+// by tiles within TILE_DIST; all that TILE_MEAN_DIST calls for, at a fraction
+// of the probes of MIH_R
+#define TILE_MIH_R 1
+#define TILE_DIST (MIH_M * (TILE_MIH_R + 1) - 1)
+
+static uint32_t *tile_start[MIH_M];
+static uint32_t *tile_ids[MIH_M];
+static size_t tile_n = 0;           // Number of records in the tables
+static uint32_t *tile_flips = NULL;  // All flip masks with at most TILE_MIH_R bits
+static size_t n_tile_flips;
+
+// Adds the tiles of records [tile_n, n_records) to the tables
+void tile_insert()
+{
+  if (tile_flips == NULL) {
+    n_tile_flips = 0;
+    tile_flips = (uint32_t *)malloc(sizeof(uint32_t) << MIH_BITS);
+    for (uint32_t m = 0; m < (1u << MIH_BITS); m++)
+      if (__builtin_popcount(m) <= TILE_MIH_R) tile_flips[n_tile_flips++] = m;
+  }
+  for (int t = 0; t < MIH_M; t++)
+    mih_build(&tile_start[t], &tile_ids[t], t,
+      tile_hashes, N_TILES, tile_masks, tile_n, n_records);
+  tile_n = n_records;
+}
+
+// Scale and offset under which tile a of one record lines up with tile b of
+// another
+static inline uint32_t tile_vote_key(int a, int b)
+{
+  const int span = 2 * TILE_LEVELS - 1;
+  int dx = tile_geom[a].x - tile_geom[b].x + TILE_LEVELS - 1;
+  int dy = tile_geom[a].y - tile_geom[b].y + TILE_LEVELS - 1;
+  return ((tile_geom[a].l * TILE_LEVELS + tile_geom[b].l) * span + dx) * span + dy;
+}
+
+// Mean distance between the tiles of records i and k that overlap when
+// lined up by `key`, over the pairs hashed in both, or -1 if fewer than
+// TILE_MIN_AGREE pairs are
+static int tile_overlap_dist(size_t i, size_t k, uint32_t key)
+{
+  const int span = 2 * TILE_LEVELS - 1;
+  int dy = key % span - (TILE_LEVELS - 1);
+  key /= span;
+  int dx = key % span - (TILE_LEVELS - 1);
+  key /= span;
+  int lb = key % TILE_LEVELS, la = key / TILE_LEVELS;
+  int first_a = la * (la + 1) * (2 * la + 1) / 6;
+  int first_b = lb * (lb + 1) * (2 * lb + 1) / 6;
+  int n = 0, sum = 0;
+  for (int ya = 0; ya <= la; ya++)
+    for (int xa = 0; xa <= la; xa++) {
+      int xb = xa - dx, yb = ya - dy;
+      if (xb < 0 || xb > lb || yb < 0 || yb > lb) continue;
+      int a = first_a + ya * (la + 1) + xa, b = first_b + yb * (lb + 1) + xb;
+      if (!(tile_masks[i] >> a & 1) || !(tile_masks[k] >> b & 1)) continue;
+      uint64_t ha[3], hb[3];
+      get_tile(i, a, ha);
+      get_tile(k, b, hb);
+      for (int t = 0; t < 3; t++) sum += __builtin_popcountll(ha[t] ^ hb[t]);
+      n++;
+    }
+  return (n < TILE_MIN_AGREE ? -1 : sum / n);
+}
+
+static int u64_cmp(const void *a, const void *b)
+{
+  uint64_t x = *(const uint64_t *)a, y = *(const uint64_t *)b;
+  return (x > y) - (x < y);
+}
+
+// Adds the records after i that match it on tiles to the `n_matches` in
+// `*o_matches`, unless already stamped with `stamp_val` (see mih_query());
+// `*io_votes` is scratch, grown as needed
+// Returns the new number of matches
+size_t tile_query(size_t i, uint32_t *stamp, uint32_t stamp_val,
+  uint64_t **io_votes, size_t *cap_votes,
+  match **o_matches, size_t *cap_matches, size_t n_matches)
+{
+  // Votes are (record << 32 | key << 8 | tile of i)
+  size_t n_votes = 0;
+  for (int a = 0; a < N_TILES; a++) {
+    if (!(tile_masks[i] >> a & 1)) continue;
+    uint64_t hash[3];
+    get_tile(i, a, hash);
+    for (int t = 0; t < MIH_M; t++) {
+      uint32_t key = mih_key(hash, t);
+      for (size_t m = 0; m < n_tile_flips; m++) {
+        uint32_t b = key ^ tile_flips[m];
+        // Rows are sorted within buckets; only records after i are wanted
+        uint32_t lo = tile_start[t][b], hi = tile_start[t][b + 1];
+        while (lo < hi) {
+          uint32_t mid = lo + (hi - lo) / 2;
+          if (tile_ids[t][mid] / N_TILES <= i) lo = mid + 1;
+          else hi = mid;
+        }
+        for (uint32_t p0 = lo; p0 < tile_start[t][b + 1]; p0 += VERIFY_BATCH) {
+          uint32_t n_batch = tile_start[t][b + 1] - p0;
+          if (n_batch > VERIFY_BATCH) n_batch = VERIFY_BATCH;
+          const uint32_t *cand_ids = tile_ids[t] + p0;
+          uint8_t cand_dist[VERIFY_BATCH];
+          hamming_batch(hash, tile_hashes, cand_ids, n_batch, cand_dist);
+          for (uint32_t j = 0; j < n_batch; j++) {
+            if (cand_dist[j] > TILE_DIST) continue;
+            uint32_t k = cand_ids[j] / N_TILES;
+            if (stamp[k] == stamp_val) continue;
+            if (n_votes == *cap_votes) {
+              *cap_votes = (*cap_votes == 0 ? 256 : *cap_votes * 2);
+              *io_votes = (uint64_t *)realloc(*io_votes,
+                sizeof(uint64_t) * *cap_votes);
+            }
+            (*io_votes)[n_votes++] = (uint64_t)k << 32 |
+              tile_vote_key(a, cand_ids[j] % N_TILES) << 8 | (uint32_t)a;
+          }
+        }
+      }
+    }
+  }
+  // Runs of equal (record, key), counting distinct tiles of i; the same pair
+  // of tiles may have been found through several tables
+  uint64_t *votes = *io_votes;
+  qsort(votes, n_votes, sizeof(uint64_t), u64_cmp);
+  for (size_t j = 0; j < n_votes; ) {
+    size_t run_end = j + 1, n_agree = 1;
+    for (; run_end < n_votes && votes[run_end] >> 8 == votes[j] >> 8; run_end++)
+      if (votes[run_end] != votes[run_end - 1]) n_agree++;
+    uint32_t k = votes[j] >> 32;
+    j = run_end;
+    if (n_agree < TILE_MIN_AGREE || stamp[k] == stamp_val) continue;
+    int mean = tile_overlap_dist(i, k, votes[run_end - 1] >> 8 & 0xffffff);
+    if (mean >= 0 && mean <= TILE_MEAN_DIST) {
+      stamp[k] = stamp_val;
+      uint8_t dist;
+      uint64_t hash[3];
+      get_hash(i, hash);
+      hamming_batch(hash, hashes, &k, 1, &dist);
+      push_match(o_matches, cap_matches, &n_matches, k, dist);
+    }
+  }
+  return n_matches;
+}
+
+// Reports pairs with at least one record in [first, n_records)
+// With first = 0 this is the full search
+// Looks up record i, for records i in [first, n_records); pairs among these
+// are reported once, from the lower id
+static void mih_verify(size_t i, verify_scratch *s, verify_buf *out)
+{
+  uint64_t hash[3];
+  get_hash(i, hash);
+  size_t n_matches = mih_query(hash, s->first, i,
+    s->stamp, i + 1, &s->matches, &s->cap_matches);
+  if (tiled) {
+    size_t n_global = n_matches;
+    n_matches = tile_query(i, s->stamp, i + 1, &s->votes, &s->cap_votes,
+      &s->matches, &s->cap_matches, n_matches);
+    if (n_matches > n_global)
+      qsort(s->matches, n_matches, sizeof(match), match_cmp);
+  }
+  for (size_t j = 0; j < n_matches; j++)
+    verify_out(out, i, s->matches[j].id, s->matches[j].dist);
+}
+
+void find_dup_mih(size_t first)
+{
+  mih_insert();
+  if (tiled) tile_insert();
+  verify_all(first, mih_verify);
+}
+
+// Nearest neighbours (-q)
+// Tables are probed at growing substring radius r, one table at a time. By
+// pigeonhole, once tables [0, t] have been probed at radius r and the rest
+// at r - 1, every record within MIH_M * r + t bits has been seen, so the
+// search stops as soon as k candidates are that close. When the buckets
+// probed would hold more ids than there are records (weighted by
+// KNN_SCAN_RATIO, as scattered ids cost more than a sequential pass), all
+// records are scanned instead.
+
+#define KNN_SCAN_RATIO 8
+
+static uint32_t *knn_masks = NULL;  // All flip masks, by popcount
+static uint32_t knn_mask_start[MIH_BITS + 2];
+
+static void knn_init_masks()
+{
+  if (knn_masks != NULL) return;
+  knn_masks = (uint32_t *)malloc(sizeof(uint32_t) << MIH_BITS);
+  memset(knn_mask_start, 0, sizeof knn_mask_start);
+  for (uint32_t m = 0; m < (1u << MIH_BITS); m++)
+    knn_mask_start[__builtin_popcount(m) + 1]++;
+  for (int r = 0; r <= MIH_BITS; r++) knn_mask_start[r + 1] += knn_mask_start[r];
+  uint32_t fill[MIH_BITS + 1];
+  memcpy(fill, knn_mask_start, sizeof fill);
+  for (uint32_t m = 0; m < (1u << MIH_BITS); m++)
+    knn_masks[fill[__builtin_popcount(m)]++] = m;
+}
+
+static int knn_cmp(const void *_a, const void *_b)
+{
+  const match *a = (const match *)_a;
+  const match *b = (const match *)_b;
+  if (a->dist != b->dist) return (a->dist < b->dist ? -1 : 1);
+  return (a->id < b->id ? -1 : a->id > b->id ? 1 : 0);
+}
+
+// Takes record `id` at distance `d` as a candidate, lowering `*io_kth` once
+// k candidates are closer than it
+static inline void knn_take(uint32_t id, int d, size_t k, int *io_kth,
+  size_t hist[193], match **o_matches, size_t *cap_matches, size_t *io_n)
+{
+  push_match(o_matches, cap_matches, io_n, id, d);
+  hist[d]++;
+  if (d < *io_kth) {
+    size_t n_le = 0;
+    for (int e = 0; e <= *io_kth; e++)
+      if ((n_le += hist[e]) >= k) {
+        *io_kth = e;
+        break;
+      }
+  }
+}
+
+// Collects the (at most) k records nearest to `hash` and no more than
+// `max_dist` bits away, sorted by distance and then id; `stamp` and `stamp_val` are as for mih_query()
+// Records not yet in the tables (see --serve) are scanned, and removed ones
+// skipped
+// Returns the number of matches written to `*o_matches` (grown as needed)
+size_t mih_knn(const uint64_t hash[3], size_t k, int max_dist,
+  uint32_t *stamp, uint32_t stamp_val,
+  match **o_matches, size_t *cap_matches)
+{
+  size_t n_matches = 0;
+  size_t n_probes = 0;
+  // Candidates by distance; kth is the k-th smallest distance so far, and
+  // farther candidates are dropped
+  size_t hist[193] = { 0 };
+  int kth = max_dist;
+  bool scan = false, done = false;
+  uint32_t ids[VERIFY_BATCH];
+  for (size_t i0 = mih_n; i0 < n_records; i0 += VERIFY_BATCH) {
+    size_t n_batch = (n_records - i0 < VERIFY_BATCH ? n_records - i0 : VERIFY_BATCH);
+    uint8_t dist[VERIFY_BATCH];
+    for (size_t j = 0; j < n_batch; j++) ids[j] = i0 + j;
+    hamming_batch(hash, hashes, ids, n_batch, dist);
+    for (size_t j = 0; j < n_batch; j++) {
+      if (dist[j] > kth || rec_removed(ids[j])) continue;
+      stamp[ids[j]] = stamp_val;
+      knn_take(ids[j], dist[j], k, &kth, hist, o_matches, cap_matches, &n_matches);
+    }
+  }
+  for (int r = 0; r <= MIH_BITS && !done; r++) {
+    uint32_t m0 = knn_mask_start[r], m1 = knn_mask_start[r + 1];
+    n_probes += (size_t)(m1 - m0) * MIH_M;
+    if (n_probes * ((n_records >> MIH_BITS) + 1) * KNN_SCAN_RATIO > n_records) {
+      scan = true;
+      break;
+    }
+    for (int t = 0; t < MIH_M && !done; t++) {
+      uint32_t key = mih_key(hash, t);
+      for (uint32_t m = m0; m < m1; m++) {
+        uint32_t b = key ^ knn_masks[m];
+        for (uint32_t p0 = mih_start[t][b]; p0 < mih_start[t][b + 1]; p0 += VERIFY_BATCH) {
+          uint32_t n_batch = mih_start[t][b + 1] - p0;
+          if (n_batch > VERIFY_BATCH) n_batch = VERIFY_BATCH;
+          const uint32_t *cand_ids = mih_ids[t] + p0;
+          uint8_t cand_dist[VERIFY_BATCH];
+          hamming_batch(hash, hashes, cand_ids, n_batch, cand_dist);
+          for (uint32_t j = 0; j < n_batch; j++) {
+            uint32_t id = cand_ids[j];
+            int d = cand_dist[j];
+            if (stamp[id] == stamp_val || d > kth) continue;
+            stamp[id] = stamp_val;
+            if (rec_removed(id)) continue;
+            knn_take(id, d, k, &kth, hist, o_matches, cap_matches, &n_matches);
+          }
+        }
+      }
+      done = (MIH_M * r + t >= kth);
+    }
+  }
+
+  if (scan) {
+    // Distances to all records, then a histogram gives the k-th distance;
+    // removed records are put out of reach
+    uint8_t *dist = (uint8_t *)malloc(n_records + 1);
+    for (size_t i0 = 0; i0 < n_records; i0 += VERIFY_BATCH) {
+      size_t n_batch = (n_records - i0 < VERIFY_BATCH ? n_records - i0 : VERIFY_BATCH);
+      for (size_t j = 0; j < n_batch; j++) ids[j] = i0 + j;
+      hamming_batch(hash, hashes, ids, n_batch, dist + i0);
+    }
+    memset(hist, 0, sizeof hist);
+    for (size_t i = 0; i < n_records; i++)
+      if (rec_removed(i)) dist[i] = 255;
+      else hist[dist[i]]++;
+    int d_max = 0;
+    size_t n_below = 0;  // Records closer than d_max
+    while (d_max < max_dist && n_below + hist[d_max] < k) n_below += hist[d_max++];
+    size_t n_ties = k - n_below;  // Taken from distance d_max, in id order
+    n_matches = 0;
+    for (size_t i = 0; i < n_records; i++)
+      if (dist[i] < d_max || (dist[i] == d_max && n_ties > 0 && n_ties--))
+        push_match(o_matches, cap_matches, &n_matches, i, dist[i]);
+    free(dist);
+  }
+
+  size_t n_kept = 0;
+  for (size_t j = 0; j < n_matches; j++)
+    if ((*o_matches)[j].dist <= kth) (*o_matches)[n_kept++] = (*o_matches)[j];
+  n_matches = n_kept;
+  qsort(*o_matches, n_matches, sizeof(match), knn_cmp);
+  return (n_matches < k ? n_matches : k);
+}
+
+// Out-of-core search (-m)
+// Only the hashes and record metadata stay resident; names are spilled as
+// they arrive (see rec_name()), and the substring tables are built and
+// scanned one at a time. A pair is taken from the first table in which its
+// substrings are within MIH_R, so each pair comes up exactly once. Pairs go
+// to a buffer sized from the memory budget, which is sorted and written out
+// as a run whenever it fills; the runs are then merged by (i, k), giving the
+// same order as find_dup_mih(0).
+
+size_t mem_budget = 0;  // Bytes, 0 for the in-memory search
+
+
+static int pair_cmp(const void *_a, const void *_b)
+{
+  const pair_ent *a = (const pair_ent *)_a;
+  const pair_ent *b = (const pair_ent *)_b;
+  if (a->i != b->i) return (a->i < b->i ? -1 : 1);
+  return (a->k < b->k ? -1 : a->k > b->k ? 1 : 0);
+}
+
+static struct {
+  size_t n_runs;
+  uint64_t run_bytes;
+  size_t buf_pairs;  // Capacity of the pair buffer
+} spill;
+
+typedef struct run_reader {
+  FILE *fp;
+  pair_ent cur;
+} run_reader;
+
+static inline bool run_less(const run_reader *a, const run_reader *b)
+{
+  return pair_cmp(&a->cur, &b->cur) < 0;
+}
+
+static void run_sift_down(run_reader *heap, size_t n, size_t p)
+{
+  while (true) {
+    size_t c = p * 2 + 1;
+    if (c >= n) break;
+    if (c + 1 < n && run_less(&heap[c + 1], &heap[c])) c++;
+    if (!run_less(&heap[c], &heap[p])) break;
+    run_reader tmp = heap[c];
+    heap[c] = heap[p];
+    heap[p] = tmp;
+    p = c;
+  }
+}
+
+static FILE *write_run(pair_ent *buf, size_t n)
+{
+  qsort(buf, n, sizeof(pair_ent), pair_cmp);
+  FILE *fp = tmpfile();
+  if (fp == NULL || fwrite(buf, sizeof(pair_ent), n, fp) != n || fflush(fp) != 0) {
+    printf("Cannot write a pair run to the temporary directory\n");
+    exit(1);
+  }
+  rewind(fp);
+  spill.n_runs++;
+  spill.run_bytes += sizeof(pair_ent) * n;
+  return fp;
+}
+
+void find_dup_ooc()
+{
+  // Resident: records, hashes, name offsets, one table and its scratch
+  size_t resident = n_records * (sizeof(record) + 3 * sizeof(uint64_t) +
+      sizeof(uint64_t) + sizeof(uint32_t) + (cluster_mode ? sizeof(uint32_t) : 0)) +
+    (sizeof(uint32_t) << MIH_BITS) * 3;
+  const size_t min_pairs = 1 << 16;
+  spill.buf_pairs = (mem_budget > resident ? (mem_budget - resident) / sizeof(pair_ent) : 0);
+  if (spill.buf_pairs < min_pairs) {
+    fprintf(stderr, "Memory budget of %zu MiB is below the %zu MiB needed for"
+      " %zu images; continuing with a minimal pair buffer\n",
+      mem_budget >> 20, (resident >> 20) + 1, n_records);
+    spill.buf_pairs = min_pairs;
+  }
+
+  mih_init_masks();
+  pair_ent *buf = NULL;
+  size_t n_buf = 0, cap_buf = 0;
+  FILE **runs = NULL;
+  size_t n_runs = 0;
+
+  for (int t = 0; t < MIH_M; t++) {
+    mih_insert_table(t);
+    for (size_t i = 0; i < n_records; i++) {
+      uint64_t hash[3];
+      get_hash(i, hash);
+      uint32_t keys[MIH_M];
+      for (int u = 0; u <= t; u++) keys[u] = mih_key(hash, u);
+      for (size_t m = 0; m < n_mih_masks; m++) {
+        uint32_t b = keys[t] ^ mih_masks[m];
+        // Ids are sorted within buckets; only k > i is wanted
+        uint32_t lo = mih_start[t][b], hi = mih_start[t][b + 1];
+        while (lo < hi) {
+          uint32_t mid = lo + (hi - lo) / 2;
+          if (mih_ids[t][mid] <= i) lo = mid + 1;
+          else hi = mid;
+        }
+        for (uint32_t p0 = lo; p0 < mih_start[t][b + 1]; p0 += VERIFY_BATCH) {
+          uint32_t n_batch = mih_start[t][b + 1] - p0;
+          if (n_batch > VERIFY_BATCH) n_batch = VERIFY_BATCH;
+          const uint32_t *cand_ids = mih_ids[t] + p0;
+          uint8_t cand_dist[VERIFY_BATCH];
+          hamming_batch(hash, hashes, cand_ids, n_batch, cand_dist);
+          for (uint32_t j = 0; j < n_batch; j++) {
+            if (cand_dist[j] > DIST_LIMIT) continue;
+            uint32_t k = cand_ids[j];
+            bool earlier = false;
+            for (int u = 0; u < t && !earlier; u++)
+              earlier = (__builtin_popcount(keys[u] ^ mih_key_of(k, u)) <= MIH_R);
+            if (earlier) continue;
+            if (n_buf == spill.buf_pairs) {
+              runs = (FILE **)realloc(runs, sizeof(FILE *) * (n_runs + 1));
+              runs[n_runs++] = write_run(buf, n_buf);
+              n_buf = 0;
+            }
+            if (n_buf >= cap_buf) {
+              cap_buf = (cap_buf == 0 ? 1024 : (cap_buf * 2));
+              if (cap_buf > spill.buf_pairs) cap_buf = spill.buf_pairs;
+              buf = (pair_ent *)realloc(buf, sizeof(pair_ent) * cap_buf);
+            }
+            buf[n_buf++] = (pair_ent){.i = i, .k = k, .dist = cand_dist[j]};
+          }
+        }
+      }
+    }
+    free(mih_start[t]);
+    free(mih_ids[t]);
+    mih_start[t] = mih_ids[t] = NULL;
+  }
+
+  if (n_runs == 0) {
+    // Everything fit in the buffer
+    qsort(buf, n_buf, sizeof(pair_ent), pair_cmp);
+    for (size_t j = 0; j < n_buf; j++) report_pair(buf[j].i, buf[j].k, buf[j].dist);
+    free(buf);
+    return;
+  }
+  if (n_buf > 0) {
+    runs = (FILE **)realloc(runs, sizeof(FILE *) * (n_runs + 1));
+    runs[n_runs++] = write_run(buf, n_buf);
+  }
+  free(buf);
+
+  // k-way merge with a binary heap of run heads
+  run_reader *heap = (run_reader *)malloc(sizeof(run_reader) * n_runs);
+  size_t n_heap = 0;
+  for (size_t r = 0; r < n_runs; r++) {
+    heap[n_heap].fp = runs[r];
+    if (fread(&heap[n_heap].cur, sizeof(pair_ent), 1, runs[r]) == 1) n_heap++;
+    else fclose(runs[r]);
+  }
+  for (size_t p = n_heap; p-- > 0; ) run_sift_down(heap, n_heap, p);
+  while (n_heap > 0) {
+    report_pair(heap[0].cur.i, heap[0].cur.k, heap[0].cur.dist);
+    if (fread(&heap[0].cur, sizeof(pair_ent), 1, heap[0].fp) != 1) {
+      fclose(heap[0].fp);
+      heap[0] = heap[--n_heap];
+    }
+    run_sift_down(heap, n_heap, 0);
+  }
+  free(heap);
+  free(runs);
+}
+
+static void print_spill_stats()
+{
+  fprintf(stderr, "spill names_bytes=%llu pair_buf=%zu runs=%zu run_bytes=%llu\n",
+    (unsigned long long)names_len, spill.buf_pairs, spill.n_runs,
+    (unsigned long long)spill.run_bytes);
+}
+
+bool use_lsh = false;
+
+void find_dup()
+{
+  if (use_lsh) find_dup_lsh();
+  else if (mem_budget > 0) find_dup_ooc();
+  else find_dup_mih(0);
+}
+
+// Persistent index
+// Layout: index_header, the records as in the hash cache (cache_ent + path),
+// then for each substring table its bucket offsets and ids as uint32 arrays.
+// Loading keeps the tables as they are; new records are appended with
+// mih_insert() and only pairs involving them are searched for.
+
+#define INDEX_MAGIC "dedupi2"
+typedef struct index_header {
+  char magic[8];
+  uint64_t n;
+  uint32_t mih_m, mih_bits, dist_limit, reserved;
+} index_header;
+
+static size_t n_indexed = 0;
+static size_t *index_table = NULL;  // Record id + 1, or 0 if the slot is empty
+static size_t index_table_mask, index_table_used;
+
+static void index_table_place(size_t i)
+{
+  const char *name = rec_name(i);
+  size_t s = str_hash(name, strlen(name)) & index_table_mask;
+  while (index_table[s] != 0) s = (s + 1) & index_table_mask;
+  index_table[s] = i + 1;
+}
+
+// Adds record i to the table of paths, which is kept at most half full
+static void index_table_add(size_t i)
+{
+  if (index_table == NULL || (index_table_used + 1) * 2 > index_table_mask + 1) {
+    size_t *old_table = index_table;
+    size_t old_size = (old_table != NULL ? index_table_mask + 1 : 0);
+    size_t table_size = 16;
+    while (table_size < (index_table_used + 1) * 4) table_size *= 2;
+    index_table_mask = table_size - 1;
+    index_table = (size_t *)calloc(table_size, sizeof(size_t));
+    for (size_t s = 0; s < old_size; s++)
+      if (old_table[s] != 0) index_table_place(old_table[s] - 1);
+    free(old_table);
+  }
+  index_table_place(i);
+  index_table_used++;
+}
+
+// Returns the id of the record for `path`, or -1 if not present
+static ssize_t index_find(const char *path)
+{
+  if (index_table == NULL) return -1;
+  for (size_t s = str_hash(path, strlen(path)) & index_table_mask;
+      index_table[s] != 0; s = (s + 1) & index_table_mask) {
+    size_t i = index_table[s] - 1;
+    if (!rec_removed(i) && strcmp(rec_name(i), path) == 0) return i;
+  }
+  return -1;
+}
+
+static bool index_has(const char *path)
+{
+  return index_find(path) >= 0;
+}
+
+// Drops removed records (see --serve), renumbering the others, and rebuilds
+// the tables
+static void index_compact()
+{
+  // Names of kept records move down the arena, in order
+  size_t n = 0;
+  name_arena_len = 0;
+  for (size_t i = 0; i < n_records; i++) {
+    if (removed[i]) continue;
+    const char *name = rec_name(i);
+    size_t len = strlen(name) + 1;
+    memmove(name_arena + name_arena_len, name, len);
+    records[n] = records[i];
+    records[n].name = name_arena_len;
+    name_arena_len += len;
+    for (int t = 0; t < 3; t++) hashes[t][n] = hashes[t][i];
+    n++;
+  }
+  n_records = n;
+  memset(removed, 0, cap_records);
+  n_removed = 0;
+  for (int t = 0; t < MIH_M; t++) {
+    free(mih_start[t]);
+    free(mih_ids[t]);
+    mih_start[t] = mih_ids[t] = NULL;
+  }
+  mih_n = 0;
+  mih_insert();
+  free(index_table);
+  index_table = NULL;
+  index_table_used = 0;
+  for (size_t i = 0; i < n_records; i++) index_table_add(i);
+}
+
+// Returns false if the file exists but cannot be used
+bool index_load(const char *path)
+{
+  FILE *fp = fopen(path, "rb");
+  if (fp == NULL) return true;
+  fseek(fp, 0, SEEK_END);
+  long len = ftell(fp);
+  fseek(fp, 0, SEEK_SET);
+  char *buf = (char *)malloc(len > 0 ? len : 1);
+  bool valid = (len >= (long)sizeof(index_header) &&
+    fread(buf, len, 1, fp) == 1);
+  fclose(fp);
+
+  index_header hdr;
+  if (valid) {
+    memcpy(&hdr, buf, sizeof hdr);
+    valid = (memcmp(hdr.magic, INDEX_MAGIC, sizeof hdr.magic) == 0);
+  }
+  size_t off = sizeof hdr;
+  for (uint64_t i = 0; valid && i < hdr.n; i++) {
+    cache_ent e;
+    if (off + sizeof e > (size_t)len) { valid = false; break; }
+    memcpy(&e, buf + off, sizeof e);
+    off += sizeof e;
+    if (off + e.path_len > (size_t)len) { valid = false; break; }
+    record r = {
+      .w = e.w, .h = e.h,
+      .size = e.size, .mtime = e.mtime,
+    };
+    add_record(buf + off, e.path_len, &r, e.hash, NULL);
+    off += e.path_len;
+  }
+  if (!valid) {
+    printf("Index %s is corrupted or outdated\n", path);
+    free(buf);
+    return false;
+  }
+
+  // Tables are reused only if built with the same parameters
+  size_t table_bytes = sizeof(uint32_t) * (((1u << MIH_BITS) + 1) + n_records);
+  if (hdr.mih_m == MIH_M && hdr.mih_bits == MIH_BITS &&
+      hdr.dist_limit == DIST_LIMIT && off + table_bytes * MIH_M == (size_t)len) {
+    for (int t = 0; t < MIH_M; t++) {
+      mih_start[t] = (uint32_t *)malloc(sizeof(uint32_t) * ((1u << MIH_BITS) + 1));
+      mih_ids[t] = (uint32_t *)malloc(sizeof(uint32_t) * (n_records + 1));
+      memcpy(mih_start[t], buf + off, sizeof(uint32_t) * ((1u << MIH_BITS) + 1));
+      off += sizeof(uint32_t) * ((1u << MIH_BITS) + 1);
+      memcpy(mih_ids[t], buf + off, sizeof(uint32_t) * n_records);
+      off += sizeof(uint32_t) * n_records;
+    }
+    mih_n = n_records;
+  }
+  free(buf);
+
+  n_indexed = n_records;
+  for (size_t i = 0; i < n_indexed; i++) index_table_add(i);
+  return true;
+}
+
+// Returns false if the index cannot be written
+bool index_save(const char *path)
+{
+  if (n_removed > 0) index_compact();
+  if (mih_n < n_records) mih_insert();
+  char *tmp_path = tmp_path_for(path);
+  FILE *fp = fopen(tmp_path, "wb");
+  if (fp == NULL) {
+    printf("Cannot save index to %s\n", tmp_path);
+    free(tmp_path);
+    return false;
+  }
+  index_header hdr = {
+    .n = n_records,
+    .mih_m = MIH_M, .mih_bits = MIH_BITS, .dist_limit = DIST_LIMIT,
+  };
+  memcpy(hdr.magic, INDEX_MAGIC, sizeof hdr.magic);
+  bool ok = (fwrite(&hdr, sizeof hdr, 1, fp) == 1);
+  for (size_t i = 0; ok && i < n_records; i++) {
+    const char *name = rec_name(i);
+    cache_ent e = record_ent(i, name);
+    ok = cache_write_ent(fp, &e, name, NULL);
+  }
+  for (int t = 0; ok && t < MIH_M; t++)
+    ok = fwrite(mih_start[t], sizeof(uint32_t), (1u << MIH_BITS) + 1, fp)
+        == (1u << MIH_BITS) + 1 &&
+      fwrite(mih_ids[t], sizeof(uint32_t), n_records, fp) == n_records;
+  ok = (fclose(fp) == 0) && ok;
+  if (!ok || rename(tmp_path, path) != 0) {
+    printf("Cannot save index to %s\n", path);
+    remove(tmp_path);
+    ok = false;
+  }
+  free(tmp_path);
+  return ok;
+}
+
+static double now_s()
+{
+  struct timeval tv;
+  gettimeofday(&tv, NULL);
+  return tv.tv_sec + tv.tv_usec * 1e-6;
+}
+
+// One line of key=value pairs on stderr, parsed by bench.sh
+static void print_stats(double ingest_s, double search_s)
+{
+  struct rusage ru;
+  getrusage(RUSAGE_SELF, &ru);
+#ifdef __APPLE__
+  long maxrss_kb = ru.ru_maxrss / 1024;
+#else
+  long maxrss_kb = ru.ru_maxrss;
+#endif
+  fprintf(stderr, "stats images=%zu ingest_s=%.3f search_s=%.3f pairs=%zu maxrss_kb=%ld\n",
+    n_records, ingest_s, search_s, n_pairs, maxrss_kb);
+}
+
+// Prints the query_k nearest indexed images of each input image, as
+// "<distance> -- <query> <indexed>" lines from nearest to farthest
+void run_queries(bool stats)
+{
+  if (mih_n < n_records) mih_insert();
+  knn_init_masks();
+  uint32_t *stamp = (uint32_t *)calloc(n_records + 1, sizeof(uint32_t));
+  match *matches = NULL;
+  size_t cap_matches = 0;
+  size_t n_queries = 0;
+  double search_s = 0;
+  char buf[1024];
+  const char *path;
+  while ((path = next_path(buf, sizeof buf)) != NULL) {
+    record r;
+    uint64_t hash[3];
+    bool cached;
+    if (!fill_record(path, &r, hash, NULL, &cached)) {
+      printf("Cannot open %s! Ignoring > <\n", path);
+      continue;
+    }
+    double t0 = now_s();
+    size_t n_matches = mih_knn(hash, query_k, query_within,
+      stamp, ++n_queries, &matches, &cap_matches);
+    search_s += now_s() - t0;
+    for (size_t j = 0; j < n_matches; j++)
+      printf("%2d -- %s %s\n", matches[j].dist, path, rec_name(matches[j].id));
+  }
+  if (stats)
+    fprintf(stderr, "query queries=%zu search_us=%.1f\n",
+      n_queries, n_queries > 0 ? search_s / n_queries * 1e6 : 0);
+  free(matches);
+  free(stamp);
+}
+
+// Server mode (--serve)
+// Keeps the index (-i) in memory and answers requests on a Unix domain
+// socket, with one thread per connection and any number of requests per
+// connection. Requests and replies are binary, in native byte order:
+//   request: serve_req, then `path_len` bytes of path
+//   reply:   serve_reply, then `n` times a serve_match followed by
+//            `path_len` bytes of path
+// SERVE_INSERT hashes the image and adds it to the index, replacing the
+// entry for the same path if any, and replies with the other indexed images
+// within DIST_LIMIT of it. SERVE_QUERY replies with the `k` nearest indexed
+// images no more than `max_dist` bits away, as -q does. SERVE_REMOVE drops
+// the image from the index. SERVE_SAVE writes the index, and the hash cache
+// (-c) if given; so do SIGINT and SIGTERM before exiting.
+// Images are decoded and hashed outside of any lock. Lookups share a read
+// lock; changes take the write lock only to append a record or mark one
+// removed. New records are scanned by every lookup until SERVE_TAIL of them
+// have piled up, and then added to the substring tables in one go, and
+// removed records are skipped by lookups until the index is next saved.
+
+#define SERVE_TAIL 4096
+#define SERVE_MAX_PATH 4096
+
+enum { SERVE_INSERT = 'I', SERVE_QUERY = 'Q', SERVE_REMOVE = 'R', SERVE_SAVE = 'S' };
+enum {
+  SERVE_OK = 0,
+  SERVE_UNREADABLE = 1,  // The image cannot be read
+  SERVE_NOT_FOUND = 2,   // Removing a path that is not indexed
+  SERVE_BAD_REQUEST = 3,
+  SERVE_SAVE_FAILED = 4,
+};
+typedef struct serve_req {
+  uint8_t op;
+  uint8_t max_dist;  // SERVE_QUERY only
+  uint16_t k;        // SERVE_QUERY only
+  uint32_t path_len;
+} serve_req;
+typedef struct serve_reply {
+  uint32_t status, n;
+} serve_reply;
+typedef struct serve_match {
+  uint32_t dist, path_len;
+} serve_match;
+
+static pthread_rwlock_t serve_lock = PTHREAD_RWLOCK_INITIALIZER;
+static const char *serve_index_path, *serve_cache_path, *serve_socket_path;
+
+// Per-connection scratch
+typedef struct serve_conn {
+  int fd;
+  uint32_t *stamp;
+  size_t cap_stamp;
+  uint32_t stamp_val;
+  match *matches;
+  size_t cap_matches;
+  char *out;
+  size_t len_out, cap_out;
+} serve_conn;
+
+static bool read_full(int fd, void *buf, size_t len)
+{
+  for (size_t done = 0; done < len; ) {
+    ssize_t n = read(fd, (char *)buf + done, len - done);
+    if (n < 0 && errno == EINTR) continue;
+    if (n <= 0) return false;
+    done += n;
+  }
+  return true;
+}
+
+static bool write_full(int fd, const void *buf, size_t len)
+{
+  for (size_t done = 0; done < len; ) {
+    ssize_t n = write(fd, (const char *)buf + done, len - done);
+    if (n < 0 && errno == EINTR) continue;
+    if (n <= 0) return false;
+    done += n;
+  }
+  return true;
+}
+
+static void serve_out(serve_conn *c, const void *p, size_t len)
+{
+  if (c->len_out + len > c->cap_out) {
+    while (c->len_out + len > c->cap_out)
+      c->cap_out = (c->cap_out == 0 ? 256 : c->cap_out * 2);
+    c->out = (char *)realloc(c->out, c->cap_out);
+  }
+  memcpy(c->out + c->len_out, p, len);
+  c->len_out += len;
+}
+
+// Looks up the records nearest to `hash` into the reply; the caller holds
+// serve_lock
+static void serve_lookup(serve_conn *c, const uint64_t hash[3], size_t k,
+  int max_dist)
+{
+  if (c->cap_stamp < n_records + 1) {
+    free(c->stamp);
+    c->cap_stamp = cap_records + 1;
+    c->stamp = (uint32_t *)calloc(c->cap_stamp, sizeof(uint32_t));
+    c->stamp_val = 0;
+  }
+  size_t n = mih_knn(hash, k, max_dist, c->stamp, ++c->stamp_val,
+    &c->matches, &c->cap_matches);
+  ((serve_reply *)c->out)->n = n;
+  for (size_t j = 0; j < n; j++) {
+    const char *name = rec_name(c->matches[j].id);
+    serve_match m = { .dist = c->matches[j].dist, .path_len = strlen(name) };
+    serve_out(c, &m, sizeof m);
+    serve_out(c, name, m.path_len);
+  }
+}
+
+static uint32_t serve_save()
+{
+  bool ok = index_save(serve_index_path);
+  if (serve_cache_path != NULL) cache_save(serve_cache_path);
+  return (ok ? SERVE_OK : SERVE_SAVE_FAILED);
+}
+
+// Handles one request into the reply
+static uint32_t serve_request(serve_conn *c, const serve_req *req,
+  const char *path)
+{
+  record r;
+  uint64_t hash[3];
+  bool cached;
+  switch (req->op) {
+    case SERVE_INSERT: {
+      if (!fill_record(path, &r, hash, NULL, &cached)) return SERVE_UNREADABLE;
+      pthread_rwlock_wrlock(&serve_lock);
+      ssize_t old = index_find(path);
+      if (old >= 0) {
+        removed[old] = 1;
+        n_removed++;
+      }
+      serve_lookup(c, hash, n_records, DIST_LIMIT);
+      add_record(path, strlen(path), &r, hash, NULL);
+      index_table_add(n_records - 1);
+      if (n_records - mih_n >= SERVE_TAIL) mih_insert();
+      pthread_rwlock_unlock(&serve_lock);
+      return SERVE_OK;
+    }
+    case SERVE_QUERY:
+      if (!fill_record(path, &r, hash, NULL, &cached)) return SERVE_UNREADABLE;
+      pthread_rwlock_rdlock(&serve_lock);
+      serve_lookup(c, hash, req->k, req->max_dist < 192 ? req->max_dist : 192);
+      pthread_rwlock_unlock(&serve_lock);
+      return SERVE_OK;
+    case SERVE_REMOVE: {
+      pthread_rwlock_wrlock(&serve_lock);
+      ssize_t i = index_find(path);
+      if (i >= 0) {
+        removed[i] = 1;
+        n_removed++;
+      }
+      pthread_rwlock_unlock(&serve_lock);
+      return (i >= 0 ? SERVE_OK : SERVE_NOT_FOUND);
+    }
+    case SERVE_SAVE: {
+      pthread_rwlock_wrlock(&serve_lock);
+      uint32_t status = serve_save();
+      pthread_rwlock_unlock(&serve_lock);
+      return status;
+    }
+  }
+  return SERVE_BAD_REQUEST;
+}
+
+static void *serve_conn_fn(void *arg)
+{
+  serve_conn c = { .fd = (int)(intptr_t)arg };
+  char *path = (char *)malloc(SERVE_MAX_PATH + 1);
+  serve_req req;
+  while (read_full(c.fd, &req, sizeof req)) {
+    bool bad = (req.path_len > SERVE_MAX_PATH);
+    if (!bad && !read_full(c.fd, path, req.path_len)) break;
+    path[bad ? 0 : req.path_len] = '\0';
+    c.len_out = 0;
+    serve_reply reply = { .status = SERVE_BAD_REQUEST, .n = 0 };
+    serve_out(&c, &reply, sizeof reply);
+    if (!bad) {
+      // The reply may grow c.out, so the status is stored afterwards
+      uint32_t status = serve_request(&c, &req, path);
+      ((serve_reply *)c.out)->status = status;
+    }
+    if (!write_full(c.fd, c.out, c.len_out) || bad) break;
+  }
+  close(c.fd);
+  free(path);
+  free(c.stamp);
+  free(c.matches);
+  free(c.out);
+  return NULL;
+}
+
+// Saves on SIGINT and SIGTERM, which are blocked in all other threads
+static void *serve_signal_fn(void *arg)
+{
+  sigset_t *set = (sigset_t *)arg;
+  int sig;
+  sigwait(set, &sig);
+  pthread_rwlock_wrlock(&serve_lock);
+  serve_save();
+  unlink(serve_socket_path);
+  exit(0);
+}
+
+// Returns only on failure to set up the socket
+int serve(const char *socket_path, const char *index_path,
+  const char *cache_path)
+{
+  serve_index_path = index_path;
+  serve_cache_path = cache_path;
+  serve_socket_path = socket_path;
+  removed = (uint8_t *)calloc(cap_records + 1, 1);
+  if (mih_n < n_records || mih_start[0] == NULL) mih_insert();
+  knn_init_masks();
+
+  struct sockaddr_un addr = { .sun_family = AF_UNIX };
+  if (strlen(socket_path) >= sizeof addr.sun_path) {
+    printf("Socket path %s is too long\n", socket_path);
+    return 1;
+  }
+  strcpy(addr.sun_path, socket_path);
+  int listen_fd = socket(AF_UNIX, SOCK_STREAM, 0);
+  unlink(socket_path);
+  if (listen_fd < 0 ||
+      bind(listen_fd, (struct sockaddr *)&addr, sizeof addr) != 0 ||
+      listen(listen_fd, 64) != 0) {
+    printf("Cannot listen on %s\n", socket_path);
+    return 1;
+  }
+
+  static sigset_t set;
+  sigemptyset(&set);
+  sigaddset(&set, SIGINT);
+  sigaddset(&set, SIGTERM);
+  pthread_sigmask(SIG_BLOCK, &set, NULL);
+  signal(SIGPIPE, SIG_IGN);
+  pthread_t signal_thread;
+  pthread_create(&signal_thread, NULL, serve_signal_fn, &set);
+  fprintf(stderr, "Serving %zu images on %s\n", n_records, socket_path);
+
+  while (true) {
+    int fd = accept(listen_fd, NULL, NULL);
+    if (fd < 0) continue;
+    pthread_t thread;
+    if (pthread_create(&thread, NULL, serve_conn_fn, (void *)(intptr_t)fd) != 0) {
+      close(fd);
+      continue;
+    }
+    pthread_detach(thread);
+  }
+}
+
+int main(int argc, char *argv[])
+{
+  bool stats = false;
+  const char *cache_path = NULL;
+  const char *index_path = NULL;
+  const char *socket_path = NULL;
+
+  static const struct option long_opts[] = {
+    {"jobs", required_argument, NULL, 'j'},
+    {"cache", required_argument, NULL, 'c'},
+    {"lsh", no_argument, NULL, 'L'},
+    {"reduced", no_argument, NULL, 'r'},
+    {"index", required_argument, NULL, 'i'},
+    {"clusters", no_argument, NULL, 'C'},
+    {"stats", no_argument, NULL, 's'},
+    {"memory", required_argument, NULL, 'm'},
+    {"query", required_argument, NULL, 'q'},
+    {"within", required_argument, NULL, 'W'},
+    {"orient", no_argument, NULL, 'o'},
+    {"tiles", no_argument, NULL, 't'},
+    {"serve", required_argument, NULL, 'S'},
+    {NULL, 0, NULL, 0},
+  };
+  int opt;
+  while ((opt = getopt_long(argc, argv, "j:c:ri:Csm:q:ot", long_opts, NULL)) != -1) {
+    switch (opt) {
+      case 'j':
+        n_threads = atoi(optarg);
+        if (n_threads <= 0) n_threads = (int)sysconf(_SC_NPROCESSORS_ONLN);
+        break;
+      case 'c':
+        cache_path = optarg;
+        break;
+      case 'L':
+        use_lsh = true;
+        break;
+      case 'r':
+        reduced_decode = true;
+        break;
+      case 'i':
+        index_path = optarg;
+        break;
+      case 'C':
+        cluster_mode = true;
+        break;
+      case 's':
+        stats = true;
+        break;
+      case 'q':
+        query_k = atoi(optarg) > 0 ? atoi(optarg) : 1;
+        break;
+      case 'o':
+        dihedral = true;
+        break;
+      case 't':
+        tiled = true;
+        break;
+      case 'S':
+        socket_path = optarg;
+        break;
+      case 'W':
+        query_within = atoi(optarg);
+        if (query_within < 0 || query_within > 192) query_within = 192;
+        break;
+      case 'm': {
+        char *end;
+        mem_budget = strtoull(optarg, &end, 10);
+        switch (toupper(*end)) {
+          case 'G': mem_budget <<= 10;  // Fallthrough
+          case 'M': mem_budget <<= 10;  // Fallthrough
+          case 'K': mem_budget <<= 10;
+        }
+        break;
+      }
+      default:
+        printf("Usage: %s [-j <threads, 0 for all cores>] [-c <hash cache>]"
+          " [-r] [-o] [-t] [-i <index>] [-q <k> [--within <bits>]] [-C] [-s] [-m <memory budget>] [--lsh]"
+          " [<image> ...]\n"
+          "       %s -i <index> [-c <hash cache>] [-r] --serve <socket>\n"
+          "Reads image paths from stdin if none are given\n"
+          "-r decodes baseline JPEGs at 1/8 scale for hashing\n"
+          "-o also matches mirrored and 90-degree rotated copies\n"
+          "-t also matches crops, by hashing overlapping tiles at several scales\n"
+          "-i adds new images to an index and reports only pairs involving them\n"
+          "-q looks up the k nearest images in the index (-i) for each input\n"
+          "   image instead, leaving the index unchanged; --within ignores\n"
+          "   images more than the given number of bits away\n"
+          "-C prints one line per duplicate group instead of pairs:\n"
+          "   representative<TAB>member<TAB>...\n"
+          "-s prints timing and memory statistics to stderr\n"
+          "-m keeps memory use within a budget (e.g. 512M, 4G) by spilling\n"
+          "   names and sorted pair runs to the temporary directory\n"
+          "--lsh uses the approximate random projection search\n"
+          "--serve keeps the index in memory and answers insert, query and\n"
+          "   remove requests on a Unix domain socket (protocol in dedup.c)\n",
+          argv[0], argv[0]);
+        return 1;
+    }
+  }
+  log_fp = (cluster_mode ? stderr : stdout);
+  if (index_path != NULL && use_lsh) {
+    printf("--index is only supported with the exact search\n");
+    return 1;
+  }
+  if (socket_path != NULL && (index_path == NULL || query_k > 0 ||
+      mem_budget > 0 || cluster_mode || dihedral || tiled || use_lsh || optind < argc)) {
+    printf("--serve needs an index (-i) and takes no images or other modes\n");
+    return 1;
+  }
+  if (query_k > 0 && (index_path == NULL || mem_budget > 0 || cluster_mode)) {
+    printf("-q needs an index (-i) and cannot be combined with -m or -C\n");
+    return 1;
+  }
+  if (mem_budget > 0 && (index_path != NULL || use_lsh)) {
+    printf("-m is only supported with the exact search, without an index\n");
+    return 1;
+  }
+  if ((dihedral || tiled) && (index_path != NULL || mem_budget > 0 || use_lsh)) {
+    printf("-o and -t are only supported with the in-memory exact search\n");
+    return 1;
+  }
+  if (dihedral && tiled) {
+    printf("-o and -t cannot be combined\n");
+    return 1;
+  }
+  if (mem_budget > 0 && (names_fp = tmpfile()) == NULL) {
+    printf("Cannot create a temporary file for names\n");
+    return 1;
+  }
+  if (optind < argc) {
+    arg_paths = argv + optind;
+    n_arg_paths = argc - optind;
+  }
+
+  dct_init();
+  hamming_init();
+  tile_init_geom();
+  if (cache_path != NULL) cache_load(cache_path);
+  if (index_path != NULL && !index_load(index_path)) return 1;
+  if (socket_path != NULL) return serve(socket_path, index_path, cache_path);
+
+  if (query_k > 0) {
+    run_queries(stats);
+    return 0;
+  }
+
+  double t0 = now_s();
+  if (n_threads > 1) {
+    process_parallel();
+  } else {
+    char buf[1024];
+    const char *path;
+    while ((path = next_path(buf, sizeof buf)) != NULL) {
+      if (arg_paths != NULL) fprintf(log_fp, "(%d/%d) ", arg_pos, n_arg_paths);
+      process(path);
+    }
+  }
+
+  if (names_fp != NULL) fflush(names_fp);
+  if (cache_path != NULL) cache_save(cache_path);
+
+  double t1 = now_s();
+  if (index_path != NULL) {
+    find_dup_mih(n_indexed);
+    index_save(index_path);
+  } else {
+    find_dup();
   }
+  if (cluster_mode) print_clusters();
+  double t2 = now_s();
 
-  find_dup();
+  if (stats) print_stats(t1 - t0, t2 - t1);
+  if (mem_budget > 0) print_spill_stats();
 
   return 0;
 }
@@ -0,0 +1,131 @@
+// gcc -o gencorpus -O2 gencorpus.c -I ../../aux -lm
+// ls ../sources/*.jpg | head -100 | ./gencorpus corpus truth.txt 1
+// Synthetic near-duplicate corpus for bench.sh
+// Every seed image becomes a group of variants: recompressed, rescaled,
+// cropped, gamma-shifted and watermarked copies. The truth file lists
+// "<group>\t<path>" for every written image; images in the same group are
+// duplicates and images in different groups are assumed not to be.
+#define STB_IMAGE_IMPLEMENTATION
+#include "stb_image.h"
+#define STB_IMAGE_RESIZE_IMPLEMENTATION
+#include "stb_image_resize.h"
+#define STB_IMAGE_WRITE_IMPLEMENTATION
+#include "stb_image_write.h"
+
+#include <ctype.h>
+#include <math.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+static const char *out_dir;
+static FILE *truth_fp;
+
+static void write_variant(int group, const char *name,
+  const unsigned char *pix, int w, int h, int quality)
+{
+  char path[1024];
+  snprintf(path, sizeof path, "%s/g%05d_%s.jpg", out_dir, group, name);
+  if (!stbi_write_jpg(path, w, h, 3, pix, quality)) {
+    printf("Cannot write %s\n", path);
+    exit(1);
+  }
+  fprintf(truth_fp, "%d\t%s\n", group, path);
+}
+
+static void variants(int group, const unsigned char *pix, int w, int h)
+{
+  unsigned char *buf = (unsigned char *)malloc((size_t)w * h * 3);
+
+  // Recompression
+  write_variant(group, "orig", pix, w, h, 95);
+  write_variant(group, "q75", pix, w, h, 75);
+  write_variant(group, "q40", pix, w, h, 40);
+
+  // Rescaling
+  for (int s = 2; s <= 4; s += 2) {
+    int sw = (w / s > 0 ? w / s : 1), sh = (h / s > 0 ? h / s : 1);
+    stbir_resize_uint8_srgb(pix, w, h, 0, buf, sw, sh, 0,
+      3, STBIR_ALPHA_CHANNEL_NONE, 0);
+    char name[16];
+    snprintf(name, sizeof name, "scale%d", s);
+    write_variant(group, name, buf, sw, sh, 90);
+  }
+
+  // Crop, keeping 85% to 95% of each side at a random offset
+  int cw = w * (85 + rand() % 11) / 100, ch = h * (85 + rand() % 11) / 100;
+  int cx = rand() % (w - cw + 1), cy = rand() % (h - ch + 1);
+  for (int y = 0; y < ch; y++)
+    memcpy(buf + (size_t)y * cw * 3, pix + ((size_t)(y + cy) * w + cx) * 3, cw * 3);
+  write_variant(group, "crop", buf, cw, ch, 90);
+
+  // Gamma shifts
+  const float gammas[2] = {0.7f, 1.4f};
+  for (int g = 0; g < 2; g++) {
+    unsigned char lut[256];
+    for (int i = 0; i < 256; i++)
+      lut[i] = (unsigned char)(powf(i / 255.0f, gammas[g]) * 255 + 0.5f);
+    for (size_t i = 0; i < (size_t)w * h * 3; i++) buf[i] = lut[pix[i]];
+    write_variant(group, g == 0 ? "gamma07" : "gamma14", buf, w, h, 90);
+  }
+
+  // Watermark: a translucent striped band in a random corner
+  memcpy(buf, pix, (size_t)w * h * 3);
+  int bw = w * 3 / 10, bh = h / 10;
+  int bx = (rand() % 2) * (w - bw), by = (rand() % 2) * (h - bh);
+  for (int y = by; y < by + bh; y++)
+    for (int x = bx; x < bx + bw; x++) {
+      int v = (((x - bx) / 4 + (y - by) / 4) % 3 == 0 ? 255 : 32);
+      for (int c = 0; c < 3; c++) {
+        unsigned char *p = &buf[((size_t)y * w + x) * 3 + c];
+        *p = (*p + v) / 2;
+      }
+    }
+  write_variant(group, "wmark", buf, w, h, 90);
+
+  free(buf);
+}
+
+int main(int argc, char *argv[])
+{
+  if (argc < 4) {
+    printf("Usage: %s <output dir> <truth file> <random seed> [<seed image> ...]\n"
+      "Reads seed image paths from stdin if none are given\n", argv[0]);
+    return 0;
+  }
+  out_dir = argv[1];
+  truth_fp = fopen(argv[2], "w");
+  if (truth_fp == NULL) {
+    printf("Cannot open %s\n", argv[2]);
+    return 1;
+  }
+  srand(atoi(argv[3]));
+
+  int group = 0;
+  int argi = 4;
+  char path[1024];
+  while (true) {
+    if (argc > 4) {
+      if (argi >= argc) break;
+      snprintf(path, sizeof path, "%s", argv[argi++]);
+    } else {
+      if (fgets(path, sizeof path, stdin) == NULL) break;
+      size_t len = strlen(path);
+      while (len > 0 && isspace(path[len - 1])) len--;
+      path[len] = '\0';
+    }
+    int w, h;
+    unsigned char *pix = stbi_load(path, &w, &h, NULL, 3);
+    if (pix == NULL) {
+      printf("Cannot open %s! Ignoring > <\n", path);
+      continue;
+    }
+    printf("(%d) %s (%dx%d)\n", group, path, w, h);
+    variants(group++, pix, w, h);
+    stbi_image_free(pix);
+  }
+
+  fclose(truth_fp);
+  return 0;
+}
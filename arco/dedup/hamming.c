@@ -0,0 +1,99 @@
+// Batch Hamming distance kernels
+// Scores one 192-bit query against many stored hashes at once. Hashes are
+// kept in structure-of-arrays layout (word t of record i at h[t][i]), and
+// candidates are given as a list of record ids, gathered by the kernel.
+// The implementation is picked at runtime: AVX-512 with VPOPCNTQ, AVX2 with
+// a nibble-lookup popcount, or portable scalar code.
+
+#include <stddef.h>
+#include <stdint.h>
+
+typedef void (*hamming_fn)(
+  const uint64_t q[3], uint64_t *const h[3],
+  const uint32_t *ids, size_t n, uint8_t *o_dist);
+
+static void hamming_scalar(
+  const uint64_t q[3], uint64_t *const h[3],
+  const uint32_t *ids, size_t n, uint8_t *o_dist)
+{
+  for (size_t i = 0; i < n; i++) {
+    uint32_t k = ids[i];
+    o_dist[i] =
+      __builtin_popcountll(q[0] ^ h[0][k]) +
+      __builtin_popcountll(q[1] ^ h[1][k]) +
+      __builtin_popcountll(q[2] ^ h[2][k]);
+  }
+}
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+
+__attribute__((target("avx2")))
+static void hamming_avx2(
+  const uint64_t q[3], uint64_t *const h[3],
+  const uint32_t *ids, size_t n, uint8_t *o_dist)
+{
+  const __m256i lut = _mm256_setr_epi8(
+    0, 1, 1, 2, 1, 2, 2, 3, 1, 2, 2, 3, 2, 3, 3, 4,
+    0, 1, 1, 2, 1, 2, 2, 3, 1, 2, 2, 3, 2, 3, 3, 4);
+  const __m256i low4 = _mm256_set1_epi8(0x0f);
+  __m256i qv[3];
+  for (int t = 0; t < 3; t++) qv[t] = _mm256_set1_epi64x((long long)q[t]);
+
+  size_t i = 0;
+  for (; i + 4 <= n; i += 4) {
+    __m128i idx = _mm_loadu_si128((const __m128i *)(ids + i));
+    // Per-byte popcounts of the three words summed (at most 24 per byte),
+    // then horizontally added within each 64-bit lane
+    __m256i cnt = _mm256_setzero_si256();
+    for (int t = 0; t < 3; t++) {
+      __m256i x = _mm256_xor_si256(qv[t],
+        _mm256_i32gather_epi64((const long long *)h[t], idx, 8));
+      __m256i lo = _mm256_and_si256(x, low4);
+      __m256i hi = _mm256_and_si256(_mm256_srli_epi16(x, 4), low4);
+      cnt = _mm256_add_epi8(cnt, _mm256_add_epi8(
+        _mm256_shuffle_epi8(lut, lo), _mm256_shuffle_epi8(lut, hi)));
+    }
+    __m256i sum = _mm256_sad_epu8(cnt, _mm256_setzero_si256());
+    uint64_t d[4];
+    _mm256_storeu_si256((__m256i *)d, sum);
+    for (int j = 0; j < 4; j++) o_dist[i + j] = (uint8_t)d[j];
+  }
+  hamming_scalar(q, h, ids + i, n - i, o_dist + i);
+}
+
+__attribute__((target("avx512f,avx512vpopcntdq")))
+static void hamming_avx512(
+  const uint64_t q[3], uint64_t *const h[3],
+  const uint32_t *ids, size_t n, uint8_t *o_dist)
+{
+  __m512i qv[3];
+  for (int t = 0; t < 3; t++) qv[t] = _mm512_set1_epi64((long long)q[t]);
+
+  size_t i = 0;
+  for (; i + 8 <= n; i += 8) {
+    __m256i idx = _mm256_loadu_si256((const __m256i *)(ids + i));
+    __m512i sum = _mm512_setzero_si512();
+    for (int t = 0; t < 3; t++)
+      sum = _mm512_add_epi64(sum, _mm512_popcnt_epi64(_mm512_xor_si512(qv[t],
+        _mm512_i32gather_epi64(idx, (const void *)h[t], 8))));
+    _mm_storel_epi64((__m128i *)(o_dist + i), _mm512_cvtepi64_epi8(sum));
+  }
+  hamming_scalar(q, h, ids + i, n - i, o_dist + i);
+}
+#endif
+
+// o_dist[i] = popcount(q ^ hash of record ids[i]), for i < n
+hamming_fn hamming_batch = hamming_scalar;
+
+void hamming_init()
+{
+#if defined(__x86_64__) || defined(__i386__)
+  __builtin_cpu_init();
+  if (__builtin_cpu_supports("avx512f") &&
+      __builtin_cpu_supports("avx512vpopcntdq"))
+    hamming_batch = hamming_avx512;
+  else if (__builtin_cpu_supports("avx2"))
+    hamming_batch = hamming_avx2;
+#endif
+}
@@ -0,0 +1,357 @@
+// DC-only baseline JPEG decoder
+// Decodes the luma plane at 1/8 scale by keeping only the DC coefficient of
+// each 8x8 block: the DC term is the block average, so no IDCT, colour
+// conversion or upsampling is done, and the only raster allocated is the
+// reduced one. AC coefficients still have to be Huffman-decoded to be skipped.
+// Progressive, lossless and arithmetic-coded files are rejected; callers
+// should fall back to a full decode.
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define HUFF_FAST_BITS 9
+
+typedef struct huff {
+  bool present;
+  // Fast lookup on the next HUFF_FAST_BITS bits: (length << 8) | symbol,
+  // or 0 if the code is longer
+  uint16_t fast[1 << HUFF_FAST_BITS];
+  int32_t maxcode[18];  // Largest code of each length, -1 if none
+  int32_t delta[17];    // Symbol index = code + delta[length]
+  uint8_t vals[256];
+} huff;
+
+typedef struct jcomp {
+  int id, hs, vs, tq;
+  int td, ta;  // Huffman table selectors in the current scan
+  int pred;
+} jcomp;
+
+typedef struct jdec {
+  const uint8_t *p, *end;
+  uint32_t buf;
+  int bits;
+  bool marker;  // A marker was reached; only zero bits are fed from now on
+
+  huff dc[4], ac[4];
+  uint16_t q0[4];  // DC entry of each quantisation table
+  jcomp comp[4];
+  int n_comp;
+  int w, h, hmax, vmax;
+  int restart_interval;
+
+  uint8_t *out;
+  int ow, oh;  // Size of `out` in blocks
+} jdec;
+
+static void huff_build(huff *t, const uint8_t counts[16], const uint8_t *syms)
+{
+  memset(t->fast, 0, sizeof t->fast);
+  int code = 0, k = 0;
+  for (int l = 1; l <= 16; l++) {
+    t->delta[l] = k - code;
+    for (int i = 0; i < counts[l - 1]; i++, k++, code++) {
+      if (l <= HUFF_FAST_BITS) {
+        int shift = HUFF_FAST_BITS - l;
+        for (int j = 0; j < (1 << shift); j++)
+          t->fast[(code << shift) | j] = (uint16_t)((l << 8) | syms[k]);
+      }
+    }
+    t->maxcode[l] = (counts[l - 1] ? code - 1 : -1);
+    code <<= 1;
+  }
+  t->maxcode[17] = 0x7fffffff;
+  memcpy(t->vals, syms, k);
+  t->present = true;
+}
+
+static inline void bits_fill(jdec *d)
+{
+  while (d->bits <= 24) {
+    uint32_t b = 0;
+    if (!d->marker && d->p < d->end) {
+      b = *d->p;
+      if (b == 0xff) {
+        uint8_t next = (d->p + 1 < d->end ? d->p[1] : 0xd9);
+        if (next == 0) {
+          d->p += 2;
+        } else {
+          d->marker = true;
+          b = 0;
+        }
+      } else {
+        d->p++;
+      }
+    }
+    d->buf |= b << (24 - d->bits);
+    d->bits += 8;
+  }
+}
+
+static inline uint32_t bits_get(jdec *d, int n)
+{
+  if (n == 0) return 0;
+  bits_fill(d);
+  uint32_t v = d->buf >> (32 - n);
+  d->buf <<= n;
+  d->bits -= n;
+  return v;
+}
+
+static inline int huff_decode(jdec *d, const huff *t)
+{
+  bits_fill(d);
+  uint16_t f = t->fast[d->buf >> (32 - HUFF_FAST_BITS)];
+  if (f != 0) {
+    int l = f >> 8;
+    d->buf <<= l;
+    d->bits -= l;
+    return f & 0xff;
+  }
+  int l = HUFF_FAST_BITS + 1;
+  while ((int32_t)(d->buf >> (32 - l)) > t->maxcode[l]) l++;
+  if (l > 16) return -1;
+  int code = d->buf >> (32 - l);
+  d->buf <<= l;
+  d->bits -= l;
+  return t->vals[code + t->delta[l]];
+}
+
+static inline int extend(uint32_t v, int s)
+{
+  return (s == 0 ? 0 : v < (1u << (s - 1)) ? (int)v - (1 << s) + 1 : (int)v);
+}
+
+// Decodes one block, storing the DC average if `dst` is non-NULL
+static bool decode_block(jdec *d, jcomp *c, uint8_t *dst)
+{
+  int s = huff_decode(d, &d->dc[c->td]);
+  if (s < 0 || s > 11) return false;
+  c->pred += extend(bits_get(d, s), s);
+  if (dst != NULL) {
+    // Inverse DCT of a DC-only block: every pixel is DC / 8 + 128
+    int v = (c->pred * d->q0[c->tq] + 4 * (c->pred >= 0 ? 1 : -1)) / 8 + 128;
+    *dst = (v < 0 ? 0 : v > 255 ? 255 : v);
+  }
+  for (int k = 1; k < 64; ) {
+    int rs = huff_decode(d, &d->ac[c->ta]);
+    if (rs < 0) return false;
+    int r = rs >> 4, sz = rs & 15;
+    if (sz == 0) {
+      if (r != 15) break;
+      k += 16;
+    } else {
+      k += r + 1;
+      bits_get(d, sz);
+    }
+  }
+  return true;
+}
+
+static bool restart(jdec *d)
+{
+  d->buf = 0;
+  d->bits = 0;
+  d->marker = false;
+  // Skip fill bytes up to the RSTn marker
+  while (d->p + 1 < d->end && !(d->p[0] == 0xff && d->p[1] >= 0xd0 && d->p[1] <= 0xd7))
+    d->p++;
+  if (d->p + 1 >= d->end) return false;
+  d->p += 2;
+  for (int i = 0; i < d->n_comp; i++) d->comp[i].pred = 0;
+  return true;
+}
+
+// Decodes one scan; returns false on error
+static bool decode_scan(jdec *d, jcomp **sc, int ns)
+{
+  d->buf = 0;
+  d->bits = 0;
+  d->marker = false;
+  for (int i = 0; i < d->n_comp; i++) d->comp[i].pred = 0;
+
+  int n_mcus_x, n_mcus_y;
+  if (ns == 1) {
+    // Non-interleaved: one block per MCU over the component's own size
+    int cw = (d->w * sc[0]->hs + d->hmax - 1) / d->hmax;
+    int ch = (d->h * sc[0]->vs + d->vmax - 1) / d->vmax;
+    n_mcus_x = (cw + 7) / 8;
+    n_mcus_y = (ch + 7) / 8;
+  } else {
+    n_mcus_x = (d->w + 8 * d->hmax - 1) / (8 * d->hmax);
+    n_mcus_y = (d->h + 8 * d->vmax - 1) / (8 * d->vmax);
+  }
+
+  int todo = d->restart_interval;
+  for (int my = 0; my < n_mcus_y; my++)
+    for (int mx = 0; mx < n_mcus_x; mx++) {
+      for (int i = 0; i < ns; i++) {
+        jcomp *c = sc[i];
+        bool is_luma = (c == &d->comp[0]);
+        int bh = (ns == 1 ? 1 : c->hs), bv = (ns == 1 ? 1 : c->vs);
+        for (int by = 0; by < bv; by++)
+          for (int bx = 0; bx < bh; bx++) {
+            int x = mx * bh + bx, y = my * bv + by;
+            uint8_t *dst = (is_luma && x < d->ow && y < d->oh ?
+              &d->out[y * d->ow + x] : NULL);
+            if (!decode_block(d, c, dst)) return false;
+          }
+      }
+      if (d->restart_interval != 0 && --todo == 0 &&
+          !(mx == n_mcus_x - 1 && my == n_mcus_y - 1)) {
+        if (!restart(d)) return false;
+        todo = d->restart_interval;
+      }
+    }
+  return true;
+}
+
+static inline int be16(const uint8_t *p) { return (p[0] << 8) | p[1]; }
+
+static uint8_t *decode(jdec *d, int *o_w, int *o_h, int *o_sw, int *o_sh)
+{
+  if (d->end - d->p < 2 || d->p[0] != 0xff || d->p[1] != 0xd8) return NULL;
+  d->p += 2;
+  while (d->end - d->p >= 4) {
+    if (d->p[0] != 0xff) { d->p++; continue; }
+    int type = d->p[1];
+    if (type == 0xff) { d->p++; continue; }
+    if (type == 0xd9) break;
+    int len = be16(d->p + 2);
+    const uint8_t *seg = d->p + 4, *seg_end = d->p + 2 + len;
+    if (len < 2 || seg_end > d->end) return NULL;
+    d->p = seg_end;
+
+    switch (type) {
+      case 0xc0: case 0xc1: {
+        // Baseline / extended sequential, Huffman-coded
+        if (d->out != NULL || len < 8 || seg[0] != 8) return NULL;
+        d->h = be16(seg + 1);
+        d->w = be16(seg + 3);
+        d->n_comp = seg[5];
+        if (d->w == 0 || d->h == 0 || (d->n_comp != 1 && d->n_comp != 3) ||
+            len < 8 + 3 * d->n_comp)
+          return NULL;
+        d->hmax = d->vmax = 1;
+        for (int i = 0; i < d->n_comp; i++) {
+          jcomp *c = &d->comp[i];
+          c->id = seg[6 + i * 3];
+          c->hs = seg[7 + i * 3] >> 4;
+          c->vs = seg[7 + i * 3] & 15;
+          c->tq = seg[8 + i * 3] & 3;
+          if (c->hs < 1 || c->hs > 4 || c->vs < 1 || c->vs > 4) return NULL;
+          if (c->hs > d->hmax) d->hmax = c->hs;
+          if (c->vs > d->vmax) d->vmax = c->vs;
+        }
+        int cw = (d->w * d->comp[0].hs + d->hmax - 1) / d->hmax;
+        int ch = (d->h * d->comp[0].vs + d->vmax - 1) / d->vmax;
+        d->ow = (cw + 7) / 8;
+        d->oh = (ch + 7) / 8;
+        d->out = (uint8_t *)calloc((size_t)d->ow * d->oh, 1);
+        break;
+      }
+      case 0xc2: case 0xc3: case 0xc5: case 0xc6: case 0xc7:
+      case 0xc9: case 0xca: case 0xcb: case 0xcd: case 0xce: case 0xcf:
+        // Progressive, lossless, hierarchical or arithmetic-coded
+        return NULL;
+      case 0xc4:
+        while (seg < seg_end) {
+          if (seg_end - seg < 17) return NULL;
+          int tc = seg[0] >> 4, th = seg[0] & 15;
+          int total = 0;
+          for (int i = 0; i < 16; i++) total += seg[1 + i];
+          if (tc > 1 || th > 3 || total > 256 || seg_end - seg < 17 + total)
+            return NULL;
+          huff_build(tc == 0 ? &d->dc[th] : &d->ac[th], seg + 1, seg + 17);
+          seg += 17 + total;
+        }
+        break;
+      case 0xdb:
+        while (seg < seg_end) {
+          int pq = seg[0] >> 4, tq = seg[0] & 15;
+          if (tq > 3 || seg_end - seg < 1 + 64 * (pq + 1)) return NULL;
+          d->q0[tq] = (pq ? be16(seg + 1) : seg[1]);
+          seg += 1 + 64 * (pq + 1);
+        }
+        break;
+      case 0xdd:
+        if (len < 4) return NULL;
+        d->restart_interval = be16(seg);
+        break;
+      case 0xda: {
+        if (d->out == NULL || len < 6) return NULL;
+        int ns = seg[0];
+        if (ns < 1 || ns > d->n_comp || len < 6 + 2 * ns) return NULL;
+        jcomp *sc[4];
+        bool has_luma = false;
+        for (int i = 0; i < ns; i++) {
+          sc[i] = NULL;
+          for (int j = 0; j < d->n_comp; j++)
+            if (d->comp[j].id == seg[1 + i * 2]) sc[i] = &d->comp[j];
+          if (sc[i] == NULL) return NULL;
+          sc[i]->td = seg[2 + i * 2] >> 4;
+          sc[i]->ta = seg[2 + i * 2] & 15;
+          if (sc[i]->td > 3 || sc[i]->ta > 3 ||
+              !d->dc[sc[i]->td].present || !d->ac[sc[i]->ta].present)
+            return NULL;
+          if (sc[i] == &d->comp[0]) has_luma = true;
+        }
+        if (!decode_scan(d, sc, ns)) return NULL;
+        if (has_luma) {
+          // Luma is complete; the remaining scans are not needed
+          *o_w = d->w;
+          *o_h = d->h;
+          *o_sw = d->ow;
+          *o_sh = d->oh;
+          uint8_t *out = d->out;
+          d->out = NULL;
+          return out;
+        }
+        // Continue after the entropy-coded data
+        while (d->p + 1 < d->end &&
+            !(d->p[0] == 0xff && d->p[1] != 0 && !(d->p[1] >= 0xd0 && d->p[1] <= 0xd7)))
+          d->p++;
+        break;
+      }
+      default:
+        break;
+    }
+  }
+  return NULL;
+}
+
+// Returns the 1/8-scale greyscale raster (`*o_sw` by `*o_sh`) of a baseline
+// JPEG file whose full size is `*o_w` by `*o_h`, or NULL if the file is not
+// a baseline JPEG or cannot be decoded. Free with free().
+unsigned char *jpeg_load_dc(const char *path, int *o_w, int *o_h, int *o_sw, int *o_sh)
+{
+  FILE *fp = fopen(path, "rb");
+  if (fp == NULL) return NULL;
+  uint8_t magic[2];
+  if (fread(magic, 2, 1, fp) != 1 || magic[0] != 0xff || magic[1] != 0xd8) {
+    fclose(fp);
+    return NULL;
+  }
+  fseek(fp, 0, SEEK_END);
+  long len = ftell(fp);
+  fseek(fp, 0, SEEK_SET);
+  uint8_t *data = (uint8_t *)malloc(len > 0 ? len : 1);
+  bool ok = (len > 0 && fread(data, len, 1, fp) == 1);
+  fclose(fp);
+  if (!ok) {
+    free(data);
+    return NULL;
+  }
+
+  jdec *d = (jdec *)calloc(1, sizeof(jdec));
+  d->p = data;
+  d->end = data + len;
+  uint8_t *out = decode(d, o_w, o_h, o_sw, o_sh);
+  free(d->out);
+  free(d);
+  free(data);
+  return out;
+}
@@ -8,15 +8,31 @@
 #include <string.h>
 #include <stdbool.h>
 
+#include "../disp/polyterms.h"
+
 double *read_fits_table(const char *path, const char **colnames, long *count);
 int read_fits_headers(const char *path, const char **keys, double *values);
-void polyfit(int n, double *u, double *v, double view_ra, double view_dec, int ord, double *o_coeff);
-void polyapply(int n, double *u, double view_ra, double view_dec, int ord, double *coeff);
+int polyfit_select_order(int n, double *u, double *v, double view_ra, double view_dec,
+  int max_ord, int folds, double *o_rms);
+int polyfit_inverse(int n, const double *u, double view_ra, double view_dec,
+  int ord, const double *coeff, int w, int h, double tol,
+  double *o_inv_coeff, double *o_rms, double *o_max);
+typedef struct polynormal polynormal;
+polynormal *polynormal_new(double view_ra, double view_dec, int ord);
+void polynormal_free(polynormal *pn);
+void polynormal_clear(polynormal *pn);
+void polynormal_update(polynormal *pn, const double u[2], const double v[2], double w);
+int polynormal_count(const polynormal *pn);
+void polynormal_solve(const polynormal *pn, double *o_coeff);
+typedef struct polyxform polyxform;
+polyxform *polyxform_new(double view_ra, double view_dec, int ord, const double *coeff);
+void polyxform_free(polyxform *px);
+void polyxform_apply(const polyxform *px, int n, double *u);
 void constell_load();
 void constell_prepare(
   double ra_min, double ra_max,
   double dec_min, double dec_max,
-  double view_ra, double view_dec, int ord, double *coeff);
+  const polyxform *px);
 void constell_draw(int iw, int ih, int scrw, int scrh, float sc, float offx, float offy);
 
 // Image and scaling
@@ -81,9 +97,22 @@ int *corr_id;
 int *refi_axy_match;
 int *refi_cat_match;
 
+// Normal equations of the fit over the refined matches, following every
+// change to them; the fit is redone on the next frame when dirty
+polynormal *refi_normal = NULL;
+bool refi_fit_dirty = false;
+
+static inline void refi_normal_update(int c, int a, double w)
+{
+  double u[2] = {cat_ra(c), cat_dec(c)};
+  double v[2] = {axy_x(a) / iw, axy_y(a) / ih};
+  polynormal_update(refi_normal, u, v, w);
+  refi_fit_dirty = true;
+}
 static inline void refi_clear_axy(int a)
 {
   if (refi_axy_match[a] != -1) {
+    refi_normal_update(refi_axy_match[a], a, -1);
     refi_cat_match[refi_axy_match[a]] = -1;
     refi_axy_match[a] = -1;
   }
@@ -91,16 +120,28 @@ static inline void refi_clear_axy(int a)
 static inline void refi_clear_cat(int c)
 {
   if (refi_cat_match[c] != -1) {
+    refi_normal_update(c, refi_cat_match[c], -1);
     refi_axy_match[refi_cat_match[c]] = -1;
     refi_cat_match[c] = -1;
   }
 }
 static inline void refi_match(int c, int a)
 {
+  if (refi_cat_match[c] == a) return;
   refi_clear_cat(c);
   refi_clear_axy(a);
   refi_cat_match[c] = a;
   refi_axy_match[a] = c;
+  refi_normal_update(c, a, 1);
+}
+// Rebuilds the normal equations from the match list, dropping the rounding
+// left over by removals
+static void refi_normal_rebuild()
+{
+  polynormal_clear(refi_normal);
+  for (long i = 0; i < nr_axy && i < axy_limit; i++)
+    if (refi_axy_match[i] != -1)
+      refi_normal_update(refi_axy_match[i], i, 1);
 }
 
 // Display and interactions
@@ -157,15 +198,32 @@ int probe_axy_limit()
   return count;
 }
 
-// For fitting
-#define MAX_ORD 10
+// For fitting, up to the highest order collage.frag renders
+#define MAX_ORD POLY_MAX_ORD
 double poly_coeff[(MAX_ORD + 1) * (MAX_ORD + 2)];
 int ord = 4;
 double *applied = NULL;
 
+// Inverse (image -> sky), fitted until the round trip is within this many
+// pixels
+#define INV_TOL 0.1
+double poly_inv_coeff[(MAX_ORD + 1) * (MAX_ORD + 2)];
+int inv_ord = -1;
+
+// Order, view centre and coefficients of the fit, then the order and
+// coefficients of its inverse, which readers of the fit alone may ignore
 const char *coeff_path = NULL;
 void save_coeff()
 {
+  double rms, max;
+  inv_ord = polyfit_inverse(nr_cat, data_rdls, view_ra, view_dec,
+    ord, poly_coeff, iw, ih, INV_TOL, poly_inv_coeff, &rms, &max);
+  if (inv_ord == -1)
+    printf("Cannot fit the inverse: the fit maps no sky onto the image\n");
+  else
+    printf("Inverse order %d, round trip RMS %.4lf px, max %.4lf px\n",
+      inv_ord, rms, max);
+
   FILE *fp = fopen(coeff_path, "w");
   if (fp == NULL) {
     printf("Cannot save to %s\n", coeff_path);
@@ -174,6 +232,11 @@ void save_coeff()
   fprintf(fp, "%d\n%.16lf %.16lf\n", ord, view_ra, view_dec);
   for (int i = 0; i < (ord + 1) * (ord + 2); i++)
     fprintf(fp, "%.16lf\n", poly_coeff[i]);
+  if (inv_ord != -1) {
+    fprintf(fp, "%d\n", inv_ord);
+    for (int i = 0; i < (inv_ord + 1) * (inv_ord + 2); i++)
+      fprintf(fp, "%.16lf\n", poly_inv_coeff[i]);
+  }
   fclose(fp);
 }
 
@@ -184,24 +247,12 @@ double grid_ra_ngroups, grid_dec_ngroups;
 double *grid_ra_applied = NULL;
 double *grid_dec_applied = NULL;
 
+// Solves the normal equations of the refined matches and maps the catalogue,
+// grid and constellations through the result
 void fit()
 {
-  double *u = (double *)malloc(sizeof(double) * axy_limit * 2);
-  double *v = (double *)malloc(sizeof(double) * axy_limit * 2);
-  int n = 0;
-  for (long i = 0; i < nr_axy && i < axy_limit; i++) {
-    if (refi_axy_match[i] != -1) {
-      u[n * 2 + 0] = cat_ra(refi_axy_match[i]);
-      u[n * 2 + 1] = cat_dec(refi_axy_match[i]);
-      v[n * 2 + 0] = axy_x(i) / iw;
-      v[n * 2 + 1] = axy_y(i) / ih;
-      n++;
-    }
-  }
-  polyfit(n, u, v, view_ra, view_dec, ord, poly_coeff);
-  free(u);
-  free(v);
-  save_coeff();
+  polynormal_solve(refi_normal, poly_coeff);
+  refi_fit_dirty = false;
 
   if (applied == NULL) {
     applied = (double *)malloc(sizeof(double) * nr_cat * 2);
@@ -230,11 +281,9 @@ void fit()
       sizeof(double) * grid_dec_ngroups * GRID_SUBDIV * 2);
   }
 
-  for (long i = 0; i < nr_cat; i++) {
-    applied[i * 2 + 0] = cat_ra(i);
-    applied[i * 2 + 1] = cat_dec(i);
-  }
-  polyapply(nr_cat, applied, view_ra, view_dec, ord, poly_coeff);
+  polyxform *px = polyxform_new(view_ra, view_dec, ord, poly_coeff);
+  memcpy(applied, data_rdls, sizeof(double) * nr_cat * 2);
+  polyxform_apply(px, nr_cat, applied);
 
   for (int i = 0; i < grid_ra_ngroups; i++) {
     for (int j = 0; j < GRID_SUBDIV; j++) {
@@ -243,7 +292,7 @@ void fit()
         (grid_dec_max - grid_dec_min) * ((double)j / (GRID_SUBDIV - 1));
     }
   }
-  polyapply(grid_ra_ngroups * GRID_SUBDIV, grid_ra_applied, view_ra, view_dec, ord, poly_coeff);
+  polyxform_apply(px, grid_ra_ngroups * GRID_SUBDIV, grid_ra_applied);
   for (int i = 0; i < grid_dec_ngroups; i++) {
     for (int j = 0; j < GRID_SUBDIV; j++) {
       grid_dec_applied[(i * GRID_SUBDIV + j) * 2 + 0] = grid_ra_min +
@@ -251,11 +300,73 @@ void fit()
       grid_dec_applied[(i * GRID_SUBDIV + j) * 2 + 1] = grid_dec_min + 10 *i;
     }
   }
-  polyapply(grid_dec_ngroups * GRID_SUBDIV, grid_dec_applied, view_ra, view_dec, ord, poly_coeff);
+  polyxform_apply(px, grid_dec_ngroups * GRID_SUBDIV, grid_dec_applied);
 
   constell_prepare(
-    grid_ra_min, grid_ra_max, grid_dec_min, grid_dec_max,
-    view_ra, view_dec, ord, poly_coeff);
+    grid_ra_min, grid_ra_max, grid_dec_min, grid_dec_max, px);
+  polyxform_free(px);
+}
+
+// Automatic order: cross-validation over the refined matches
+#define CV_FOLDS 5
+void select_order()
+{
+  double *u = (double *)malloc(sizeof(double) * axy_limit * 2);
+  double *v = (double *)malloc(sizeof(double) * axy_limit * 2);
+  int n = 0;
+  for (long i = 0; i < nr_axy && i < axy_limit; i++) {
+    if (refi_axy_match[i] != -1) {
+      u[n * 2 + 0] = cat_ra(refi_axy_match[i]);
+      u[n * 2 + 1] = cat_dec(refi_axy_match[i]);
+      v[n * 2 + 0] = axy_x(i);
+      v[n * 2 + 1] = axy_y(i);
+      n++;
+    }
+  }
+  double rms[MAX_ORD + 1];
+  int best = polyfit_select_order(n, u, v, view_ra, view_dec, MAX_ORD, CV_FOLDS, rms);
+  free(u);
+  free(v);
+  if (best == -1) {
+    printf("Too few matches for cross-validation, order kept at %d\n", ord);
+    return;
+  }
+
+  for (int o = 1; o <= MAX_ORD; o++)
+    printf("Order %2d: held-out RMS %.3lf px%s\n", o, rms[o], o == best ? " *" : "");
+  if (best != ord) {
+    ord = best;
+    printf("Order set to %d\n", ord);
+    polynormal_free(refi_normal);
+    refi_normal = polynormal_new(view_ra, view_dec, ord);
+    refi_normal_rebuild();
+  }
+  fit();
+  save_coeff();
+}
+
+void draw_grid(Color color)
+{
+  for (int i = 0; i < grid_ra_ngroups; i++) {
+    for (int j = 1; j < GRID_SUBDIV; j++)
+      DrawLineEx(scale(
+        grid_ra_applied[(i * GRID_SUBDIV + (j - 0)) * 2 + 0] * iw,
+        grid_ra_applied[(i * GRID_SUBDIV + (j - 0)) * 2 + 1] * ih
+      ), scale(
+        grid_ra_applied[(i * GRID_SUBDIV + (j - 1)) * 2 + 0] * iw,
+        grid_ra_applied[(i * GRID_SUBDIV + (j - 1)) * 2 + 1] * ih
+      ), 2, color);
+  }
+  for (int i = 0; i < grid_dec_ngroups; i++) {
+    for (int j = 1; j < GRID_SUBDIV; j++)
+      DrawLineEx(scale(
+        grid_dec_applied[(i * GRID_SUBDIV + (j - 0)) * 2 + 0] * iw,
+        grid_dec_applied[(i * GRID_SUBDIV + (j - 0)) * 2 + 1] * ih
+      ), scale(
+        grid_dec_applied[(i * GRID_SUBDIV + (j - 1)) * 2 + 0] * iw,
+        grid_dec_applied[(i * GRID_SUBDIV + (j - 1)) * 2 + 1] * ih
+      ), 2, color);
+  }
 }
 
 void update_and_draw()
@@ -277,6 +388,9 @@ void update_and_draw()
   offx = clamp(offx, scrw / sc / 2, iw - scrw / sc / 2);
   #undef clamp
 
+  // Order selection
+  if (IsKeyPressed(KEY_O)) select_order();
+
   // Display mode switch
   if (IsKeyPressed(KEY_SPACE)) {
     dispmode = (dispmode + 1) % DISP_NUM;
@@ -285,10 +399,13 @@ void update_and_draw()
       rectsel = false;
     }
     if (dispmode == DISP_APPLIED) {
+      refi_normal_rebuild();
       fit();
+      save_coeff();
     }
     initial_calculated = 0;
   }
+  if (refi_fit_dirty) fit();
   bool show_calculated = (dispmode == DISP_REFINED && IsKeyDown(KEY_TAB));
   if (initial_calculated == 2 && show_calculated) initial_calculated = 1;
   else if (initial_calculated == 1 && !show_calculated) initial_calculated = 0;
@@ -393,6 +510,20 @@ void update_and_draw()
           2, GREEN);
     }
   } else if (dispmode == DISP_REFINED) {
+    // Live fit: grid and residuals of the matches, once they determine it
+    bool live_fit = (applied != NULL &&
+      polynormal_count(refi_normal) >= (ord + 1) * (ord + 2) / 2);
+    if (live_fit) {
+      draw_grid(Fade(GRAY, 0.25));
+      for (long i = 0; i < nr_axy && i < axy_limit; i++) {
+        if (refi_axy_match[i] != -1)
+          DrawLineEx(
+            scale(axy_x(i), axy_y(i)),
+            scale(applied[refi_axy_match[i] * 2 + 0] * iw,
+                  applied[refi_axy_match[i] * 2 + 1] * ih),
+            1, SKYBLUE);
+      }
+    }
     for (long i = 0; i < nr_axy && i < axy_limit; i++) {
       DrawRing(scale(axy_x(i), axy_y(i)),
         4, 6, 0, 360, 12,
@@ -426,26 +557,7 @@ void update_and_draw()
     }
   } else if (dispmode == DISP_APPLIED) {
     // Grid
-    for (int i = 0; i < grid_ra_ngroups; i++) {
-      for (int j = 1; j < GRID_SUBDIV; j++)
-        DrawLineEx(scale(
-          grid_ra_applied[(i * GRID_SUBDIV + (j - 0)) * 2 + 0] * iw,
-          grid_ra_applied[(i * GRID_SUBDIV + (j - 0)) * 2 + 1] * ih
-        ), scale(
-          grid_ra_applied[(i * GRID_SUBDIV + (j - 1)) * 2 + 0] * iw,
-          grid_ra_applied[(i * GRID_SUBDIV + (j - 1)) * 2 + 1] * ih
-        ), 2, Fade(GRAY, 0.5));
-    }
-    for (int i = 0; i < grid_dec_ngroups; i++) {
-      for (int j = 1; j < GRID_SUBDIV; j++)
-        DrawLineEx(scale(
-          grid_dec_applied[(i * GRID_SUBDIV + (j - 0)) * 2 + 0] * iw,
-          grid_dec_applied[(i * GRID_SUBDIV + (j - 0)) * 2 + 1] * ih
-        ), scale(
-          grid_dec_applied[(i * GRID_SUBDIV + (j - 1)) * 2 + 0] * iw,
-          grid_dec_applied[(i * GRID_SUBDIV + (j - 1)) * 2 + 1] * ih
-        ), 2, Fade(GRAY, 0.5));
-    }
+    draw_grid(Fade(GRAY, 0.5));
     // Constellations
     constell_draw(iw, ih, scrw, scrh, sc, offx, offy);
     // Image objects
@@ -569,6 +681,9 @@ int main(int argc, char *argv[])
     fclose(fp_coeff);
   }
 
+  refi_normal = polynormal_new(view_ra, view_dec, ord);
+  refi_normal_rebuild();
+
   constell_load();
 
   while (!WindowShouldClose()) {
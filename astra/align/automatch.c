@@ -0,0 +1,518 @@
+// gcc -o automatch -O2 automatch.c readfits.c polyfit.c -I ../../aux/cfitsio-4.5.0 ../../aux/cfitsio-4.5.0/*.o -lm -lcurl -lz
+// ./automatch ../img-processed/32186236600_7605b3bdec_b{.axy,.rdls,.corr,.wcs,.refi,.coeff}
+// Headless refinement: matches image objects (axy) with catalogue stars
+// (rdls) without the align GUI, and writes the .refi and .coeff files that
+// align saves, so that the result can still be opened there for review.
+// Starting from the correspondences of the solver (corr), every round pairs
+// each catalogue star with its mutual nearest image object under the current
+// model, rejects outliers by RANSAC and refits on the inliers, raising the
+// order as the matches allow, until the set of matches no longer changes.
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+
+#include "../disp/polyterms.h"
+
+double *read_fits_table(const char *path, const char **colnames, long *count);
+int read_fits_headers(const char *path, const char **keys, double *values);
+void polyfit(int n, double *u, double *v, double view_ra, double view_dec, int ord, double *o_coeff);
+int polyfit_select_order(int n, double *u, double *v, double view_ra, double view_dec,
+  int max_ord, int folds, double *o_rms);
+int polyfit_inverse(int n, const double *u, double view_ra, double view_dec,
+  int ord, const double *coeff, int w, int h, double tol,
+  double *o_inv_coeff, double *o_rms, double *o_max);
+typedef struct polyxform polyxform;
+polyxform *polyxform_new(double view_ra, double view_dec, int ord, const double *coeff);
+polyxform *polyxform_new_inverse(double view_ra, double view_dec, int ord, const double *inv_coeff);
+void polyxform_free(polyxform *px);
+void polyxform_apply(const polyxform *px, int n, double *u);
+
+// FITS tables
+
+const char *col_names_axy[] = {"X", "Y", NULL};
+long nr_axy;
+double *data_axy;
+#define axy_x(_i) data_axy[(_i) * 2 + 0]
+#define axy_y(_i) data_axy[(_i) * 2 + 1]
+
+const char *col_names_rdls[] = {"RA", "DEC", NULL};
+long nr_rdls;
+double *data_rdls;
+#define cat_ra(_i)  data_rdls[(_i) * 2 + 0]
+#define cat_dec(_i) data_rdls[(_i) * 2 + 1]
+#define nr_cat nr_rdls
+
+const char *col_names_corr[] = {"field_id", "index_id", NULL};
+long nr_corr;
+double *data_corr;
+#define corr_axyid(_i)  (long)data_corr[(_i) * 2 + 0]
+#define corr_catid(_i)  (long)data_corr[(_i) * 2 + 1]
+
+const char *header_names_wcs[] = {"CRVAL1", "CRVAL2", "IMAGEW", "IMAGEH", NULL};
+double view_ra, view_dec;
+int iw, ih;
+
+int axy_limit;
+
+// Matching, up to the highest order collage.frag renders
+#define MAX_ORD POLY_MAX_ORD
+#define MAX_ROUNDS 30
+// Matches needed per coefficient before an order is used
+#define MATCHES_PER_COEFF 3
+// Order of the first fit to the seeds; later fits go up one order at a
+// time, so that the model extends to the edges of the field smoothly rather
+// than by extrapolating a high order from the seeds
+#define START_ORD 2
+// RANSAC samples a correction to the current model of this order, which
+// takes few matches per sample however high the model order is
+#define RANSAC_ORD 1
+_Static_assert(RANSAC_ORD >= 1, "samples are checked as triangles");
+#define RANSAC_ITERS 500
+// Samples whose first three image positions span a triangle smaller than
+// this fraction of the image area are skipped, as a collinear or repeated
+// sample leaves the fit undetermined
+#define RANSAC_MIN_AREA 1e-4
+// Inlier threshold in pixels: relative to the larger image side in the
+// first round, then a multiple of the median residual, which outliers do not
+// inflate as they would the RMS, but no less than the minimum; candidates
+// are searched within twice the threshold
+#define THRESH_INITIAL 0.05
+#define THRESH_MEDIAN 3
+#define THRESH_MIN 1.5
+
+#define n_coeffs(_ord) (((_ord) + 1) * ((_ord) + 2) / 2)
+
+int ord = 4;
+// With "auto" for the order, matching runs at the default order, and the
+// final fit takes the order that cross-validates best over the matches
+bool auto_ord = false;
+#define CV_FOLDS 5
+// Inverse (image -> sky), fitted until the round trip is within this many
+// pixels
+#define INV_TOL 0.1
+double poly_coeff[(MAX_ORD + 1) * (MAX_ORD + 2)];
+int fit_ord = 0;
+
+// Candidate pairs of the round
+int n_cand;
+int *cand_cat, *cand_axy;
+double *cand_u;     // (RA, Dec)
+double *cand_v;     // Image position, as fractions of the width and height
+double *cand_pred;  // Image position under the current model
+bool *cand_inlier;
+
+int *refi_axy_match;
+int *refi_cat_match;
+
+static inline double sq_dist_px(double dx, double dy)
+{
+  return (dx * iw) * (dx * iw) + (dy * ih) * (dy * ih);
+}
+
+// Mutual nearest neighbours within radius (in pixels) under the current
+// model
+static void propose(double radius)
+{
+  double *pred = (double *)malloc(sizeof(double) * nr_cat * 2);
+  memcpy(pred, data_rdls, sizeof(double) * nr_cat * 2);
+  polyxform *px = polyxform_new(view_ra, view_dec, fit_ord, poly_coeff);
+  polyxform_apply(px, nr_cat, pred);
+  polyxform_free(px);
+
+  int *best_axy = (int *)malloc(sizeof(int) * nr_cat);
+  int *best_cat = (int *)malloc(sizeof(int) * axy_limit);
+  double *best_cat_dsq = (double *)malloc(sizeof(double) * axy_limit);
+  for (int a = 0; a < axy_limit; a++) {
+    best_cat[a] = -1;
+    best_cat_dsq[a] = radius * radius;
+  }
+  for (long c = 0; c < nr_cat; c++) {
+    best_axy[c] = -1;
+    double dsq_best = radius * radius;
+    for (int a = 0; a < axy_limit; a++) {
+      double dsq = sq_dist_px(
+        pred[c * 2 + 0] - axy_x(a) / iw, pred[c * 2 + 1] - axy_y(a) / ih);
+      if (dsq < dsq_best) { dsq_best = dsq; best_axy[c] = a; }
+      if (dsq < best_cat_dsq[a]) { best_cat_dsq[a] = dsq; best_cat[a] = c; }
+    }
+  }
+
+  n_cand = 0;
+  for (long c = 0; c < nr_cat; c++) {
+    int a = best_axy[c];
+    if (a != -1 && best_cat[a] == c) {
+      cand_cat[n_cand] = c;
+      cand_axy[n_cand] = a;
+      n_cand++;
+    }
+  }
+
+  free(pred);
+  free(best_axy);
+  free(best_cat);
+  free(best_cat_dsq);
+}
+
+// Seeds: the solver's correspondences
+static void propose_corr()
+{
+  n_cand = 0;
+  for (long i = 0; i < nr_corr; i++) {
+    if (corr_axyid(i) < axy_limit) {
+      cand_cat[n_cand] = corr_catid(i);
+      cand_axy[n_cand] = corr_axyid(i);
+      n_cand++;
+    }
+  }
+}
+
+// Marks the candidates agreeing with the current model up to a correction of
+// order RANSAC_ORD, fitted to the residuals of random minimal samples; the
+// correction with the most inliers wins
+// Returns the number of inliers
+static int ransac(double thresh)
+{
+  for (int k = 0; k < n_cand; k++) {
+    cand_u[k * 2 + 0] = cat_ra(cand_cat[k]);
+    cand_u[k * 2 + 1] = cat_dec(cand_cat[k]);
+    cand_v[k * 2 + 0] = axy_x(cand_axy[k]) / iw;
+    cand_v[k * 2 + 1] = axy_y(cand_axy[k]) / ih;
+  }
+  memcpy(cand_pred, cand_u, sizeof(double) * n_cand * 2);
+  polyxform *px = polyxform_new(view_ra, view_dec, fit_ord, poly_coeff);
+  polyxform_apply(px, n_cand, cand_pred);
+  polyxform_free(px);
+
+  const int s = n_coeffs(RANSAC_ORD);
+  if (n_cand < s) {
+    for (int k = 0; k < n_cand; k++) cand_inlier[k] = false;
+    return 0;
+  }
+
+  // Residuals of the current model, and the correction predicted for them
+  double *res = (double *)malloc(sizeof(double) * n_cand * 2);
+  double *corr = (double *)malloc(sizeof(double) * n_cand * 2);
+  for (int k = 0; k < n_cand * 2; k++) res[k] = cand_v[k] - cand_pred[k];
+
+  double sample_u[s * 2], sample_res[s * 2];
+  double coeff[(RANSAC_ORD + 1) * (RANSAC_ORD + 2)];
+  double best_coeff[(RANSAC_ORD + 1) * (RANSAC_ORD + 2)];
+  int best_count = -1;
+  double best_err = INFINITY;
+  for (int it = 0; it < RANSAC_ITERS; it++) {
+    int pick[s];
+    for (int i = 0; i < s; i++) {
+      bool dup;
+      do {
+        pick[i] = rand() % n_cand;
+        dup = false;
+        for (int j = 0; j < i; j++) dup |= (pick[j] == pick[i]);
+      } while (dup);
+      memcpy(&sample_u[i * 2], &cand_u[pick[i] * 2], sizeof(double) * 2);
+      memcpy(&sample_res[i * 2], &res[pick[i] * 2], sizeof(double) * 2);
+    }
+    double ax = (cand_v[pick[1] * 2 + 0] - cand_v[pick[0] * 2 + 0]) * iw;
+    double ay = (cand_v[pick[1] * 2 + 1] - cand_v[pick[0] * 2 + 1]) * ih;
+    double bx = (cand_v[pick[2] * 2 + 0] - cand_v[pick[0] * 2 + 0]) * iw;
+    double by = (cand_v[pick[2] * 2 + 1] - cand_v[pick[0] * 2 + 1]) * ih;
+    if (fabs(ax * by - ay * bx) / 2 < RANSAC_MIN_AREA * iw * ih) continue;
+    polyfit(s, sample_u, sample_res, view_ra, view_dec, RANSAC_ORD, coeff);
+
+    memcpy(corr, cand_u, sizeof(double) * n_cand * 2);
+    px = polyxform_new(view_ra, view_dec, RANSAC_ORD, coeff);
+    polyxform_apply(px, n_cand, corr);
+    polyxform_free(px);
+    int count = 0;
+    double err = 0;
+    for (int k = 0; k < n_cand; k++) {
+      double dsq = sq_dist_px(
+        res[k * 2 + 0] - corr[k * 2 + 0], res[k * 2 + 1] - corr[k * 2 + 1]);
+      if (dsq < thresh * thresh) { count++; err += dsq; }
+    }
+    if (count > best_count || (count == best_count && err < best_err)) {
+      best_count = count;
+      best_err = err;
+      memcpy(best_coeff, coeff, sizeof coeff);
+    }
+  }
+
+  if (best_count == -1) {
+    for (int k = 0; k < n_cand; k++) cand_inlier[k] = false;
+    free(res);
+    free(corr);
+    return 0;
+  }
+  memcpy(corr, cand_u, sizeof(double) * n_cand * 2);
+  px = polyxform_new(view_ra, view_dec, RANSAC_ORD, best_coeff);
+  polyxform_apply(px, n_cand, corr);
+  polyxform_free(px);
+  for (int k = 0; k < n_cand; k++)
+    cand_inlier[k] = (sq_dist_px(
+      res[k * 2 + 0] - corr[k * 2 + 0], res[k * 2 + 1] - corr[k * 2 + 1]
+    ) < thresh * thresh);
+
+  free(res);
+  free(corr);
+  return best_count;
+}
+
+static int cmp_double(const void *a, const void *b)
+{
+  double x = *(const double *)a, y = *(const double *)b;
+  return x < y ? -1 : x > y ? 1 : 0;
+}
+
+// Fits the model to the inliers, at the highest order they support and at
+// most one above the last, and records them as the matches
+// Returns the RMS residual in pixels, and the median in o_median
+static double refit(int n_in, double *o_median)
+{
+  double *u = (double *)malloc(sizeof(double) * n_in * 2);
+  double *v = (double *)malloc(sizeof(double) * n_in * 2);
+  memset(refi_axy_match, -1, sizeof(int) * axy_limit);
+  memset(refi_cat_match, -1, sizeof(int) * nr_cat);
+  int n = 0;
+  for (int k = 0; k < n_cand; k++) {
+    if (!cand_inlier[k]) continue;
+    // Seeds may pair an object or a star more than once
+    if (refi_axy_match[cand_axy[k]] != -1 || refi_cat_match[cand_cat[k]] != -1)
+      continue;
+    refi_axy_match[cand_axy[k]] = cand_cat[k];
+    refi_cat_match[cand_cat[k]] = cand_axy[k];
+    memcpy(&u[n * 2], &cand_u[k * 2], sizeof(double) * 2);
+    memcpy(&v[n * 2], &cand_v[k * 2], sizeof(double) * 2);
+    n++;
+  }
+
+  int o = (fit_ord == 0 ? START_ORD : fit_ord + 1);
+  if (o > ord) o = ord;
+  while (o > 1 && n < MATCHES_PER_COEFF * n_coeffs(o)) o--;
+  fit_ord = o;
+  polyfit(n, u, v, view_ra, view_dec, fit_ord, poly_coeff);
+
+  polyxform *px = polyxform_new(view_ra, view_dec, fit_ord, poly_coeff);
+  polyxform_apply(px, n, u);
+  polyxform_free(px);
+  double sum = 0;
+  for (int k = 0; k < n; k++) {
+    // Residuals kept in u
+    u[k] = sq_dist_px(u[k * 2 + 0] - v[k * 2 + 0], u[k * 2 + 1] - v[k * 2 + 1]);
+    sum += u[k];
+  }
+  qsort(u, n, sizeof(double), cmp_double);
+  *o_median = sqrt(u[n / 2]);
+
+  free(u);
+  free(v);
+  return sqrt(sum / n);
+}
+
+int probe_axy_limit(const char *path)
+{
+  FILE *fp = fopen(path, "r");
+  if (fp == NULL) return 500;
+  int count = 0, x;
+  while (fscanf(fp, "%d", &x) == 1) count++;
+  fclose(fp);
+  return count;
+}
+
+int main(int argc, char *argv[])
+{
+  if (argc < 7) {
+    printf("Usage: %s <objs FITS (axy)> "
+      "<catalogue FITS (rdls)> "
+      "<link FITS (corr)> "
+      "<geometry FITS (wcs)> "
+      "<save path> "
+      "<coefficients save path> [<order> | auto]\n", argv[0]);
+    return 0;
+  }
+
+  if ((data_axy = read_fits_table(argv[1], col_names_axy, &nr_axy)) == NULL) {
+    printf("Error loading the objects table\n");
+    return 1;
+  }
+  if ((data_rdls = read_fits_table(argv[2], col_names_rdls, &nr_rdls)) == NULL) {
+    printf("Error loading the catalogue table (RA, Dec)\n");
+    return 1;
+  }
+  if ((data_corr = read_fits_table(argv[3], col_names_corr, &nr_corr)) == NULL) {
+    printf("Error loading the correlation table\n");
+    return 1;
+  }
+  double wcs_header_values[4];
+  if (read_fits_headers(argv[4], header_names_wcs, wcs_header_values) == 0) {
+    printf("Error loading the geometry (WCS) metadata\n");
+    return 1;
+  }
+  view_ra = wcs_header_values[0];
+  view_dec = wcs_header_values[1];
+  iw = wcs_header_values[2];
+  ih = wcs_header_values[3];
+  if (iw <= 0 || ih <= 0) {
+    printf("Image size missing from the geometry (WCS) metadata\n");
+    return 1;
+  }
+
+  if (argc > 7 && strcmp(argv[7], "auto") == 0) {
+    auto_ord = true;
+  } else if (argc > 7) {
+    ord = atoi(argv[7]);
+    if (ord < 1 || ord > MAX_ORD) {
+      printf("Order should be between 1 and %d\n", MAX_ORD);
+      return 1;
+    }
+  }
+
+  // Same number of objects as align works with, so that it reads the result
+  axy_limit = probe_axy_limit(argv[5]);
+  if (axy_limit > nr_axy) axy_limit = nr_axy;
+
+  cand_cat = (int *)malloc(sizeof(int) * (nr_corr + nr_cat));
+  cand_axy = (int *)malloc(sizeof(int) * (nr_corr + nr_cat));
+  cand_u = (double *)malloc(sizeof(double) * (nr_corr + nr_cat) * 2);
+  cand_v = (double *)malloc(sizeof(double) * (nr_corr + nr_cat) * 2);
+  cand_pred = (double *)malloc(sizeof(double) * (nr_corr + nr_cat) * 2);
+  cand_inlier = (bool *)malloc(sizeof(bool) * (nr_corr + nr_cat));
+  refi_axy_match = (int *)malloc(sizeof(int) * axy_limit);
+  refi_cat_match = (int *)malloc(sizeof(int) * nr_cat);
+  int *last_axy_match = (int *)malloc(sizeof(int) * axy_limit);
+  memset(last_axy_match, -1, sizeof(int) * axy_limit);
+
+  // The zero model makes the first round plain RANSAC on the seeds
+  memset(poly_coeff, 0, sizeof poly_coeff);
+  fit_ord = 0;
+  srand(1);
+
+  double thresh = THRESH_INITIAL * (iw > ih ? iw : ih);
+  double rms = 0, median;
+  int n_in = 0;
+  int round;
+  for (round = 0; round < MAX_ROUNDS; round++) {
+    if (round == 0) propose_corr();
+    else propose(thresh * 2);
+    n_in = ransac(thresh);
+    if (n_in < MATCHES_PER_COEFF * n_coeffs(1)) {
+      printf("Too few matches (%d)\n", n_in);
+      return 1;
+    }
+    int last_ord = fit_ord;
+    rms = refit(n_in, &median);
+    thresh = THRESH_MEDIAN * median;
+    if (thresh < THRESH_MIN) thresh = THRESH_MIN;
+    // Stable once the order settles and the matches repeat
+    if (fit_ord == last_ord &&
+        memcmp(last_axy_match, refi_axy_match, sizeof(int) * axy_limit) == 0)
+      break;
+    memcpy(last_axy_match, refi_axy_match, sizeof(int) * axy_limit);
+  }
+
+  int n_match = 0;
+  for (int i = 0; i < axy_limit; i++) n_match += (refi_axy_match[i] != -1);
+  printf("%d matches, order %d, RMS %.3lf px, %d rounds%s\n",
+    n_match, fit_ord, rms, round < MAX_ROUNDS ? round + 1 : MAX_ROUNDS,
+    round == MAX_ROUNDS ? " (not settled)" : "");
+
+  if (auto_ord) {
+    double *u = (double *)malloc(sizeof(double) * n_match * 2);
+    double *v = (double *)malloc(sizeof(double) * n_match * 2);
+    int n = 0;
+    for (int i = 0; i < axy_limit; i++) {
+      if (refi_axy_match[i] != -1) {
+        u[n * 2 + 0] = cat_ra(refi_axy_match[i]);
+        u[n * 2 + 1] = cat_dec(refi_axy_match[i]);
+        v[n * 2 + 0] = axy_x(i);
+        v[n * 2 + 1] = axy_y(i);
+        n++;
+      }
+    }
+    double cv_rms[MAX_ORD + 1];
+    int cv_ord = polyfit_select_order(n, u, v, view_ra, view_dec, MAX_ORD, CV_FOLDS, cv_rms);
+    if (cv_ord == -1) {
+      printf("Too few matches for cross-validation, order kept at %d\n", fit_ord);
+    } else {
+      fit_ord = cv_ord;
+      printf("Order %d by cross-validation, held-out RMS %.3lf px\n", fit_ord, cv_rms[fit_ord]);
+      for (int k = 0; k < n; k++) {
+        v[k * 2 + 0] /= iw;
+        v[k * 2 + 1] /= ih;
+      }
+      polyfit(n, u, v, view_ra, view_dec, fit_ord, poly_coeff);
+    }
+    free(u);
+    free(v);
+  }
+
+  FILE *fp = fopen(argv[5], "w");
+  if (fp == NULL) {
+    printf("Cannot save to %s\n", argv[5]);
+    return 1;
+  }
+  for (int i = 0; i < axy_limit; i++)
+    fprintf(fp, "%d ", refi_axy_match[i]);
+  fclose(fp);
+
+  // Laid out as align saves it
+  double inv_coeff[(MAX_ORD + 1) * (MAX_ORD + 2)];
+  double inv_rms, inv_max;
+  int inv_ord = polyfit_inverse(nr_cat, data_rdls, view_ra, view_dec,
+    fit_ord, poly_coeff, iw, ih, INV_TOL, inv_coeff, &inv_rms, &inv_max);
+  if (inv_ord == -1)
+    printf("Cannot fit the inverse: the fit maps no sky onto the image\n");
+  else
+    printf("Inverse order %d, round trip RMS %.4lf px, max %.4lf px\n",
+      inv_ord, inv_rms, inv_max);
+
+  // Matched objects looked up through the inverse, as the .coeff will be
+  // read, against the catalogue stars they were matched with
+  if (inv_ord != -1 && n_match > 0) {
+    polyxform *px = polyxform_new_inverse(view_ra, view_dec, inv_ord, inv_coeff);
+    double *p = (double *)malloc(sizeof(double) * n_match * 2);
+    int n = 0;
+    for (int i = 0; i < axy_limit; i++) {
+      if (refi_axy_match[i] != -1) {
+        p[n * 2 + 0] = axy_x(i) / iw;
+        p[n * 2 + 1] = axy_y(i) / ih;
+        n++;
+      }
+    }
+    polyxform_apply(px, n, p);
+    double sum = 0;
+    n = 0;
+    for (int i = 0; i < axy_limit; i++) {
+      if (refi_axy_match[i] != -1) {
+        double ra1 = p[n * 2 + 0] * (M_PI / 180), dec1 = p[n * 2 + 1] * (M_PI / 180);
+        double ra2 = cat_ra(refi_axy_match[i]) * (M_PI / 180);
+        double dec2 = cat_dec(refi_axy_match[i]) * (M_PI / 180);
+        double c = sin(dec1) * sin(dec2) + cos(dec1) * cos(dec2) * cos(ra1 - ra2);
+        double d = acos(c < 1 ? c : 1) * (180 / M_PI * 3600);
+        sum += d * d;
+        n++;
+      }
+    }
+    printf("Matches through the inverse: RMS %.3lf arcsec from their stars\n",
+      sqrt(sum / n));
+    free(p);
+    polyxform_free(px);
+  }
+
+  fp = fopen(argv[6], "w");
+  if (fp == NULL) {
+    printf("Cannot save to %s\n", argv[6]);
+    return 1;
+  }
+  fprintf(fp, "%d\n%.16lf %.16lf\n", fit_ord, view_ra, view_dec);
+  for (int i = 0; i < (fit_ord + 1) * (fit_ord + 2); i++)
+    fprintf(fp, "%.16lf\n", poly_coeff[i]);
+  if (inv_ord != -1) {
+    fprintf(fp, "%d\n", inv_ord);
+    for (int i = 0; i < (inv_ord + 1) * (inv_ord + 2); i++)
+      fprintf(fp, "%.16lf\n", inv_coeff[i]);
+  }
+  fclose(fp);
+
+  return 0;
+}
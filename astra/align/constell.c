@@ -7,7 +7,8 @@ typedef struct { float x, y, z; } vec3;
 
 #include "../disp/constelldb.h"
 
-void polyapply(int n, double *u, double view_ra, double view_dec, int ord, double *coeff);
+typedef struct polyxform polyxform;
+void polyxform_apply(const polyxform *px, int n, double *u);
 
 void constell_load()
 {
@@ -17,13 +18,16 @@ void constell_load()
 
 static Vector2 *scrlines = NULL;
 static size_t n_scrlines, cap_scrlines = 0;
+// Sky positions of all line points, transformed in one batch
+static double *skylines = NULL;
+static size_t cap_skylines = 0;
 
 static const int SUBDIV = 4;
 
 void constell_prepare(
   double ra_min, double ra_max,
   double dec_min, double dec_max,
-  double view_ra, double view_dec, int ord, double *coeff)
+  const polyxform *px)
 {
   n_scrlines = 0;
   for (int i = 0; i < n_constell; i++) {
@@ -39,7 +43,11 @@ void constell_prepare(
         double xA = cos(raA) * cos(decA), yA = sin(raA) * cos(decA), zA = sin(decA);
         double xB = cos(raB) * cos(decB), yB = sin(raB) * cos(decB), zB = sin(decB);
         double O = acos(xA * xB + yA * yB + zA * zB);
-        double u[(SUBDIV + 1) * 2];
+        if (n_scrlines + (SUBDIV + 1) > cap_skylines) {
+          cap_skylines = (cap_skylines == 0 ? 32 : cap_skylines * 2);
+          skylines = (double *)realloc(skylines, sizeof(double) * 2 * cap_skylines);
+        }
+        double *u = skylines + n_scrlines * 2;
         for (int k = 0; k <= SUBDIV; k++) {
           double t = (double)k / SUBDIV;
           // Slerp(A, B, t)
@@ -51,16 +59,17 @@ void constell_prepare(
           u[k * 2 + 0] = atan2(yC, xC) * (180/M_PI);
           u[k * 2 + 1] = asin(zC) * (180/M_PI);
         }
-        polyapply(SUBDIV + 1, u, view_ra, view_dec, ord, coeff);
-        if (n_scrlines + (SUBDIV + 1) > cap_scrlines) {
-          cap_scrlines = (cap_scrlines == 0 ? 32 : cap_scrlines * 2);
-          scrlines = (Vector2 *)realloc(scrlines, sizeof(Vector2) * cap_scrlines);
-        }
-        for (int k = 0; k <= SUBDIV; k++)
-          scrlines[n_scrlines++] = (Vector2){u[k * 2 + 0], u[k * 2 + 1]};
+        n_scrlines += SUBDIV + 1;
       }
     }
   }
+  polyxform_apply(px, n_scrlines, skylines);
+  if (n_scrlines > cap_scrlines) {
+    cap_scrlines = cap_skylines;
+    scrlines = (Vector2 *)realloc(scrlines, sizeof(Vector2) * cap_scrlines);
+  }
+  for (size_t i = 0; i < n_scrlines; i++)
+    scrlines[i] = (Vector2){skylines[i * 2 + 0], skylines[i * 2 + 1]};
   //printf("%zu %.4lf %.4lf\n", n_scrlines, scrlines[0].x, scrlines[0].y);
 }
 
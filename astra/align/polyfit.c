@@ -1,13 +1,26 @@
 #include <math.h>
+#include <stdbool.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 
-// C (n*m) = A^-1 (n*n) B (n*m)
-static void invert_mul(int n, int m, double *a, double *b, double *c);
+#include "../disp/polyterms.h"
+
+// Rotation moving the view centre to (0, 0, -1), by rotating around the Z axis
+// first (to RA=0), and then the Y axis (to Dec=-90deg)
+static void view_rot(double view_ra, double view_dec, double o_rot[3][3])
+{
+  double rot_ra = -view_ra * (M_PI / 180);
+  double rot_dec = (-90 - view_dec) * (M_PI / 180);
+  double cr = cos(rot_ra), sr = sin(rot_ra);
+  double cd = cos(rot_dec), sd = sin(rot_dec);
+  o_rot[0][0] = cd * cr; o_rot[0][1] = -cd * sr; o_rot[0][2] = -sd;
+  o_rot[1][0] = sr;      o_rot[1][1] = cr;       o_rot[1][2] = 0;
+  o_rot[2][0] = sd * cr; o_rot[2][1] = -sd * sr; o_rot[2][2] = cd;
+}
 
 static inline void stereo_proj(
-  double view_ra, double view_dec,
+  const double rot[3][3],
   double ra, double dec,
   double *o_x, double *o_y)
 {
@@ -16,173 +29,622 @@ static inline void stereo_proj(
   double x = cos(dec) * cos(ra);
   double y = cos(dec) * sin(ra);
   double z = sin(dec);
-  // Move target to (0, 0, -1)
-  // by rotating around Z axis first (to RA=0), and then X axis (to Dec=-90deg)
-  double rot_ra = -view_ra * (M_PI / 180);
-  double rot_dec = (-90 - view_dec) * (M_PI / 180);
-  double x0, y0, z0;
-  // Around Z
-  x0 = x; y0 = y;
-  x = x0 * cos(rot_ra) - y0 * sin(rot_ra);
-  y = x0 * sin(rot_ra) + y0 * cos(rot_ra);
-  // Around Y
-  x0 = x; z0 = z;
-  x = x0 * cos(rot_dec) - z0 * sin(rot_dec);
-  z = x0 * sin(rot_dec) + z0 * cos(rot_dec);
+  double xr = rot[0][0] * x + rot[0][1] * y + rot[0][2] * z;
+  double yr = rot[1][0] * x + rot[1][1] * y + rot[1][2] * z;
+  double zr = rot[2][0] * x + rot[2][1] * y + rot[2][2] * z;
   // Stereographic projection
-  *o_x = x / (1 - z);
-  *o_y = y / (1 - z);
+  *o_x = xr / (1 - zr);
+  *o_y = yr / (1 - zr);
+}
+
+// Inverse of stereo_proj(), back to (RA, Dec) in degrees
+static inline void stereo_unproj(
+  const double rot[3][3],
+  double x, double y,
+  double *o_ra, double *o_dec)
+{
+  double r2 = x * x + y * y;
+  double xr = 2 * x / (1 + r2);
+  double yr = 2 * y / (1 + r2);
+  double zr = (r2 - 1) / (r2 + 1);
+  // The rotation is orthonormal, so its inverse is its transpose
+  double xs = rot[0][0] * xr + rot[1][0] * yr + rot[2][0] * zr;
+  double ys = rot[0][1] * xr + rot[1][1] * yr + rot[2][1] * zr;
+  double zs = rot[0][2] * xr + rot[1][2] * yr + rot[2][2] * zr;
+  double ra = atan2(ys, xs) * (180 / M_PI);
+  *o_ra = (ra < 0 ? ra + 360 : ra);
+  *o_dec = asin(zs < -1 ? -1 : zs > 1 ? 1 : zs) * (180 / M_PI);
 }
 
 // For 0<=k<n, 0<=c<=1:
 // v[2k+c] =
 //  let ux = u[2k+0], uy = u[2k+1]
 //  sum_{i,j>=0, i+j<=ord} C[c,i,j] ux^i uy^j
-// C[c,i,j] = o_coeff[c * (ord+1)*(ord+2)/2 + (i*(ord+1) + j - i*(i-1)/2)]
+// C[c,i,j] = coeff[id(i, j) * 2 + c], where (ux, uy) is the stereographic
+// projection of the sky position around the view centre
 
 #define id(_i, _j) (((_i)+(_j)) * ((_i)+(_j)+1) / 2 + (_i))
-#define C(_c, _i, _j) COEFF[id((_i), (_j)) * 2 + (_c)]
 
-#define COEFF o_coeff
-void polyfit(int n, double *u, double *v, double view_ra, double view_dec, int ord, double *o_coeff)
+// Fitting
+// Least squares on the normal equations (X^T X) B = X^T Y, where row k of X
+// holds the monomials of point k in coefficient order, B the coefficients
+// and Y the image positions. Points are taken in blocks of POLYFIT_BLOCK:
+// the monomial rows of a block are built once, stored per monomial so that
+// each is contiguous over the points, and the block is added to the upper
+// triangle of X^T X and to X^T Y as one rank-k update. The system is then
+// solved by Cholesky factorisation.
+#define POLYFIT_BLOCK 64
+
+// Sum over a block of a[p] * b[p], in four interleaved partial sums so that
+// the loop vectorises without reassociating
+static inline double block_dot(const double *restrict a, const double *restrict b)
 {
-  int n_coeffs = (ord + 1) * (ord + 2) / 2;
-  // Initial guess: LLS
-  // XB = Y
-  // X: n * n_coeffs (u)
-  // Y: n * 2 (v)
-  // B: n_coeffs * 2 
-  // B = inv(X^T X) * X^T * Y
-  double *XTX = (double *)malloc(sizeof(double) * n_coeffs * n_coeffs);
-  double *uxpow = (double *)malloc(sizeof(double) * (ord + 1));
-  double *uypow = (double *)malloc(sizeof(double) * (ord + 1));
-  memset(XTX, 0, sizeof(double) * n_coeffs * n_coeffs);
-  uxpow[0] = uypow[0] = 1;
+  double s[4] = { 0 };
+  for (int p = 0; p < POLYFIT_BLOCK; p += 4)
+    for (int l = 0; l < 4; l++) s[l] += a[p + l] * b[p + l];
+  return (s[0] + s[1]) + (s[2] + s[3]);
+}
+
+// Cholesky factorisation A = U^T U of symmetric A (n*n, upper triangle
+// used), writing U^T into the lower triangle, row by row. Stops at the first
+// pivot that is not positive
+// Returns the number of rows factored, n if A is positive definite. As the
+// factor of a leading block of A is the leading block of the factor, the
+// rows factored solve every leading block up to that size
+static int cholesky_factor(int n, double *a)
+{
+  #define A(_i, _j) a[(_i) * n + (_j)]
   for (int i = 0; i < n; i++) {
-    double x, y;
-    stereo_proj(view_ra, view_dec, u[i * 2 + 0], u[i * 2 + 1], &x, &y);
-    for (int j = 1; j <= ord; j++) {
-      uxpow[j] = uxpow[j - 1] * x;
-      uypow[j] = uypow[j - 1] * y;
-    }
-    for (int xp1 = 0; xp1 <= ord; xp1++)
-    for (int yp1 = 0; yp1 <= ord - xp1; yp1++) {
-      double val1 = uxpow[xp1] * uypow[yp1];
-      for (int xp2 = 0; xp2 <= ord; xp2++)
-      for (int yp2 = 0; yp2 <= ord - xp2; yp2++) {
-        double val2 = uxpow[xp2] * uypow[yp2];
-        XTX[id(xp1, yp1) * n_coeffs + id(xp2, yp2)]
-          += val1 * val2;
+    for (int j = 0; j <= i; j++) {
+      double sum = A(j, i);  // Upper triangle
+      for (int k = 0; k < j; k++) sum -= A(i, k) * A(j, k);
+      if (i == j) {
+        if (!(sum > 0)) return i;
+        A(i, i) = sqrt(sum);
+      } else {
+        A(i, j) = sum / A(j, j);
       }
     }
   }
-  // Ridge regression
+  #undef A
+  return n;
+}
+
+// Solves A_k X = B for the leading k*k block A_k of the factored n*n A, and
+// m right-hand sides (B and X k*m)
+static void cholesky_subst(int n, int k, int m, const double *a, const double *b, double *x)
+{
+  #define A(_i, _j) a[(_i) * n + (_j)]
+  // L y = b, then L^T x = y
+  for (int c = 0; c < m; c++) {
+    for (int i = 0; i < k; i++) {
+      double sum = b[i * m + c];
+      for (int l = 0; l < i; l++) sum -= A(i, l) * x[l * m + c];
+      x[i * m + c] = sum / A(i, i);
+    }
+    for (int i = k - 1; i >= 0; i--) {
+      double sum = x[i * m + c];
+      for (int l = i + 1; l < k; l++) sum -= A(l, i) * x[l * m + c];
+      x[i * m + c] = sum / A(i, i);
+    }
+  }
+  #undef A
+}
+
+// Solves the normal equations with a small ridge term, overwriting XTX
+static void normal_solve(int n_coeffs, double *XTX, const double *XTY, double *o_coeff)
+{
   for (int i = 0; i < n_coeffs; i++) XTX[i * n_coeffs + i] += 1e-8;
-  // X^T * Y
-  double *XTY = (double *)malloc(sizeof(double) * n_coeffs * 2);
-  memset(XTY, 0, sizeof(double) * n_coeffs * 2);
-  for (int i = 0; i < n; i++) {
-    double x, y;
-    stereo_proj(view_ra, view_dec, u[i * 2 + 0], u[i * 2 + 1], &x, &y);
-    for (int j = 1; j <= ord; j++) {
-      uxpow[j] = uxpow[j - 1] * x;
-      uypow[j] = uypow[j - 1] * y;
+  if (cholesky_factor(n_coeffs, XTX) < n_coeffs) {
+    printf("Cannot fit: normal equations are not positive definite\n");
+    memset(o_coeff, 0, sizeof(double) * n_coeffs * 2);
+    return;
+  }
+  cholesky_subst(n_coeffs, n_coeffs, 2, XTX, XTY, o_coeff);
+}
+
+// Adds points start, start + step, ... (below n) to the normal equations
+// XTX and XTY of order ord, and their squared targets to YTY if given
+// u is projected with the view rotation rot, or taken as plane coordinates
+// if rot is NULL
+static void normal_accum(const double rot[3][3], int ord,
+  int n, const double *u, const double *v, int start, int step,
+  double *XTX, double *XTY, double *YTY)
+{
+  int n_coeffs = (ord + 1) * (ord + 2) / 2;
+  // Monomials of the block, row id(i, j) holding x^i y^j for every point,
+  // and the targets
+  double (*rows)[POLYFIT_BLOCK] = (double (*)[POLYFIT_BLOCK])malloc(
+    sizeof(double) * POLYFIT_BLOCK * n_coeffs);
+  double vb[2][POLYFIT_BLOCK];
+  double uxpow[ord + 1], uypow[ord + 1];
+  uxpow[0] = uypow[0] = 1;
+
+  for (int k0 = start; k0 < n; k0 += POLYFIT_BLOCK * step) {
+    for (int p = 0; p < POLYFIT_BLOCK; p++) {
+      int k = k0 + p * step;
+      // The last block is padded with zero rows, which add nothing
+      if (k >= n) {
+        for (int a = 0; a < n_coeffs; a++) rows[a][p] = 0;
+        vb[0][p] = vb[1][p] = 0;
+        continue;
+      }
+      double x = u[k * 2 + 0], y = u[k * 2 + 1];
+      if (rot != NULL) stereo_proj(rot, x, y, &x, &y);
+      for (int d = 1; d <= ord; d++) {
+        uxpow[d] = uxpow[d - 1] * x;
+        uypow[d] = uypow[d - 1] * y;
+      }
+      for (int i = 0; i <= ord; i++)
+        for (int j = 0; j <= ord - i; j++)
+          rows[id(i, j)][p] = uxpow[i] * uypow[j];
+      vb[0][p] = v[k * 2 + 0];
+      vb[1][p] = v[k * 2 + 1];
+    }
+    for (int a = 0; a < n_coeffs; a++) {
+      for (int b = a; b < n_coeffs; b++)
+        XTX[a * n_coeffs + b] += block_dot(rows[a], rows[b]);
+      XTY[a * 2 + 0] += block_dot(rows[a], vb[0]);
+      XTY[a * 2 + 1] += block_dot(rows[a], vb[1]);
     }
-    for (int xp1 = 0; xp1 <= ord; xp1++)
-    for (int yp1 = 0; yp1 <= ord - xp1; yp1++) {
-      int j = id(xp1, yp1);
-      for (int k = 0; k < 2; k++)
-        XTY[j * 2 + k] += uxpow[xp1] * uypow[yp1] * v[i * 2 + k];
+    if (YTY != NULL) {
+      YTY[0] += block_dot(vb[0], vb[0]);
+      YTY[1] += block_dot(vb[1], vb[1]);
     }
   }
-  // Invert and multiply
-/*
-  double LLS_sol[n_coeffs][2];
-  invert_mul(n_coeffs, 2, &XTX[0], &XTY[0], &LLS_sol[0][0]);
-  for (int c = 0; c < 2; c++) {
-    for (int xp1 = 0; xp1 <= ord; xp1++)
-    for (int yp1 = 0; yp1 <= ord - xp1; yp1++) {
-      C(c, xp1, yp1) = LLS_sol[id(xp1, yp1)][c];
+
+  free(rows);
+}
+
+void polyfit(int n, double *u, double *v, double view_ra, double view_dec, int ord, double *o_coeff)
+{
+  int n_coeffs = (ord + 1) * (ord + 2) / 2;
+  double rot[3][3];
+  view_rot(view_ra, view_dec, rot);
+  double *XTX = (double *)calloc(n_coeffs * n_coeffs, sizeof(double));
+  double *XTY = (double *)calloc(n_coeffs * 2, sizeof(double));
+  normal_accum(rot, ord, n, u, v, 0, 1, XTX, XTY, NULL);
+  normal_solve(n_coeffs, XTX, XTY, o_coeff);
+  free(XTX);
+  free(XTY);
+}
+
+// Order selection
+// K-fold cross-validation: point k is held out in fold k mod K, and every
+// order is fitted to the other folds and scored on the held-out one. The
+// monomials are in graded order, so the normal equations of an order are
+// the leading block of those of any higher order; the folds are accumulated
+// once at max_ord, each training set is factored once, and every order is
+// solved on leading blocks of that factor. The held-out squared residual is
+// |y - X b|^2 = Y^T Y - 2 b^T X^T Y + b^T X^T X b over the fold's own sums,
+// so no point is visited twice either.
+// Fills o_rms[ord] for 1 <= ord <= max_ord with the held-out RMS distance
+// (in the units of v; INFINITY where some training set is too small) and
+// returns the lowest order within POLYFIT_CV_TOL of the minimum: past the
+// point where the residual levels off, higher orders only fit the noise, and
+// swing the more at the edges of the field
+// Returns -1 if no order can be cross-validated with the points given
+#define POLYFIT_CV_TOL 0.01
+
+int polyfit_select_order(int n, double *u, double *v, double view_ra, double view_dec,
+  int max_ord, int folds, double *o_rms)
+{
+  int n_coeffs = (max_ord + 1) * (max_ord + 2) / 2;
+  int nn = n_coeffs * n_coeffs;
+  double rot[3][3];
+  view_rot(view_ra, view_dec, rot);
+  double *XTX = (double *)calloc((folds + 1) * nn, sizeof(double));
+  double *XTY = (double *)calloc((folds + 1) * n_coeffs * 2, sizeof(double));
+  double *YTY = (double *)calloc((folds + 1) * 2, sizeof(double));
+  // Sums of the folds, then of all points in the last slot
+  #define F_XTX(_f) (XTX + (_f) * nn)
+  #define F_XTY(_f) (XTY + (_f) * n_coeffs * 2)
+  #define F_YTY(_f) (YTY + (_f) * 2)
+  for (int f = 0; f < folds; f++) {
+    normal_accum(rot, max_ord, n, u, v, f, folds, F_XTX(f), F_XTY(f), F_YTY(f));
+    for (int i = 0; i < nn; i++) F_XTX(folds)[i] += F_XTX(f)[i];
+    for (int i = 0; i < n_coeffs * 2; i++) F_XTY(folds)[i] += F_XTY(f)[i];
+  }
+
+  double *train = (double *)malloc(sizeof(double) * nn);
+  double *train_y = (double *)malloc(sizeof(double) * n_coeffs * 2);
+  double *b = (double *)malloc(sizeof(double) * n_coeffs * 2);
+  double sse[max_ord + 1];
+  for (int o = 0; o <= max_ord; o++) sse[o] = 0;
+
+  for (int f = 0; f < folds; f++) {
+    const double *hXTX = F_XTX(f), *hXTY = F_XTY(f), *hYTY = F_YTY(f);
+    for (int i = 0; i < nn; i++) train[i] = F_XTX(folds)[i] - hXTX[i];
+    for (int i = 0; i < n_coeffs * 2; i++) train_y[i] = F_XTY(folds)[i] - hXTY[i];
+    for (int i = 0; i < n_coeffs; i++) train[i * n_coeffs + i] += 1e-8;
+    int n_train = n - (n - f + folds - 1) / folds;
+    int k_max = cholesky_factor(n_coeffs, train);
+
+    for (int o = 1; o <= max_ord; o++) {
+      int k = (o + 1) * (o + 2) / 2;
+      if (k > k_max || n_train < k) {
+        sse[o] = INFINITY;
+        continue;
+      }
+      cholesky_subst(n_coeffs, k, 2, train, train_y, b);
+      for (int c = 0; c < 2; c++) {
+        double e = hYTY[c];
+        for (int i = 0; i < k; i++) {
+          // Row i of the symmetric X^T X, from the upper triangle
+          double xb = 0;
+          for (int j = 0; j < k; j++)
+            xb += hXTX[i < j ? i * n_coeffs + j : j * n_coeffs + i] * b[j * 2 + c];
+          e += b[i * 2 + c] * (xb - 2 * hXTY[i * 2 + c]);
+        }
+        sse[o] += (e > 0 ? e : 0);
+      }
     }
   }
-*/
-  invert_mul(n_coeffs, 2, &XTX[0], &XTY[0], o_coeff);
+  #undef F_XTX
+  #undef F_XTY
+  #undef F_YTY
+
+  double min_rms = INFINITY;
+  for (int o = 1; o <= max_ord; o++) {
+    o_rms[o] = sqrt(sse[o] / n);
+    if (o_rms[o] < min_rms) min_rms = o_rms[o];
+  }
+  int best = -1;
+  if (isfinite(min_rms)) {
+    best = 1;
+    while (!(o_rms[best] <= min_rms * (1 + POLYFIT_CV_TOL))) best++;
+  }
 
   free(XTX);
-  free(uxpow);
-  free(uypow);
   free(XTY);
+  free(YTY);
+  free(train);
+  free(train_y);
+  free(b);
+  return best;
 }
 
-#undef COEFF
-#define COEFF coeff
-void polyapply(int n, double *u, double view_ra, double view_dec, int ord, double *coeff)
+// Normal equations kept across edits
+// X^T X (upper triangle) and X^T Y are updated one point at a time, as a
+// rank-1 update adding or removing its monomial row, so that a fit follows
+// the matches as they change without revisiting the others. Removal
+// subtracts what the addition added; the rounding left behind is dropped
+// whenever the set becomes empty, and polynormal_clear() starts afresh.
+typedef struct polynormal {
+  double rot[3][3];
+  int ord, n_coeffs;
+  int n;
+  double *XTX, *XTY;
+  double *work;
+} polynormal;
+
+void polynormal_clear(polynormal *pn)
 {
+  pn->n = 0;
+  memset(pn->XTX, 0, sizeof(double) * pn->n_coeffs * pn->n_coeffs);
+  memset(pn->XTY, 0, sizeof(double) * pn->n_coeffs * 2);
+}
+
+polynormal *polynormal_new(double view_ra, double view_dec, int ord)
+{
+  polynormal *pn = (polynormal *)malloc(sizeof(polynormal));
+  view_rot(view_ra, view_dec, pn->rot);
+  pn->ord = ord;
+  pn->n_coeffs = (ord + 1) * (ord + 2) / 2;
+  pn->XTX = (double *)malloc(sizeof(double) * pn->n_coeffs * pn->n_coeffs);
+  pn->XTY = (double *)malloc(sizeof(double) * pn->n_coeffs * 2);
+  pn->work = (double *)malloc(sizeof(double) * pn->n_coeffs * pn->n_coeffs);
+  polynormal_clear(pn);
+  return pn;
+}
+
+void polynormal_free(polynormal *pn)
+{
+  free(pn->XTX);
+  free(pn->XTY);
+  free(pn->work);
+  free(pn);
+}
+
+// Adds (w = 1) or removes (w = -1) the point u = (RA, Dec) in degrees,
+// mapped to v in fractions of the image width and height
+void polynormal_update(polynormal *pn, const double u[2], const double v[2], double w)
+{
+  int ord = pn->ord, n_coeffs = pn->n_coeffs;
+  double x, y;
+  stereo_proj(pn->rot, u[0], u[1], &x, &y);
   double uxpow[ord + 1], uypow[ord + 1];
   uxpow[0] = uypow[0] = 1;
-  for (int k = 0; k < n; k++) {
-    double x, y;
-    stereo_proj(view_ra, view_dec, u[k * 2 + 0], u[k * 2 + 1], &x, &y);
-    for (int i = 1; i <= ord; i++) {
-      uxpow[i] = uxpow[i - 1] * x;
-      uypow[i] = uypow[i - 1] * y;
+  for (int d = 1; d <= ord; d++) {
+    uxpow[d] = uxpow[d - 1] * x;
+    uypow[d] = uypow[d - 1] * y;
+  }
+  double row[n_coeffs];
+  for (int i = 0; i <= ord; i++)
+    for (int j = 0; j <= ord - i; j++)
+      row[id(i, j)] = uxpow[i] * uypow[j];
+
+  pn->n += (w > 0 ? 1 : -1);
+  if (pn->n <= 0) {
+    polynormal_clear(pn);
+    return;
+  }
+  for (int a = 0; a < n_coeffs; a++) {
+    double wa = w * row[a];
+    for (int b = a; b < n_coeffs; b++)
+      pn->XTX[a * n_coeffs + b] += wa * row[b];
+    pn->XTY[a * 2 + 0] += wa * v[0];
+    pn->XTY[a * 2 + 1] += wa * v[1];
+  }
+}
+
+// Number of points currently in the equations
+int polynormal_count(const polynormal *pn)
+{
+  return pn->n;
+}
+
+// Coefficients fitted to the current points, in the layout of polyfit()
+void polynormal_solve(const polynormal *pn, double *o_coeff)
+{
+  memcpy(pn->work, pn->XTX, sizeof(double) * pn->n_coeffs * pn->n_coeffs);
+  normal_solve(pn->n_coeffs, pn->work, pn->XTY, o_coeff);
+}
+
+// Transform context
+// Holds the view rotation and the coefficients of one fit, and maps batches
+// of points from the sky to the image, or with an inverse fit from the image
+// to the sky. Points are processed in blocks of
+// POLYX_BLOCK in structure-of-arrays layout by an evaluator specialised for
+// the order, with every term unrolled (from the lists in polyterms.h, which
+// collage.frag shares) inside one loop over the points, which vectorises.
+#define POLYX_BLOCK 64
+
+typedef void (*polyx_kernel)(const double *coeff,
+  const double *x, const double *y, double *o_vx, double *o_vy);
+
+// Powers d of x and y for point p
+#define POLYX_POW(_d) \
+  xp[_d] = xp[_d - 1] * x[p]; \
+  yp[_d] = yp[_d - 1] * y[p];
+// Adds term k (x^i y^j) for point p
+#define POLYX_TERM(_k, _i, _j) \
+  vx += coeff[(_k) * 2 + 0] * (xp[_i] * yp[_j]); \
+  vy += coeff[(_k) * 2 + 1] * (xp[_i] * yp[_j]);
+
+#define POLYX_KERNEL(_n) \
+static void polyx_eval_##_n(const double *restrict coeff, \
+  const double *restrict x, const double *restrict y, \
+  double *restrict o_vx, double *restrict o_vy) \
+{ \
+  (void)x; (void)y;  /* Unread at order 0 */ \
+  for (int p = 0; p < POLYX_BLOCK; p++) { \
+    double xp[_n + 1], yp[_n + 1]; \
+    xp[0] = yp[0] = 1; \
+    POLY_POWS_##_n(POLYX_POW) \
+    double vx = 0, vy = 0; \
+    POLY_UPTO_##_n(POLYX_TERM) \
+    o_vx[p] = vx; \
+    o_vy[p] = vy; \
+  } \
+}
+
+POLYX_KERNEL(0) POLYX_KERNEL(1) POLYX_KERNEL(2) POLYX_KERNEL(3)
+POLYX_KERNEL(4) POLYX_KERNEL(5) POLYX_KERNEL(6) POLYX_KERNEL(7)
+POLYX_KERNEL(8) POLYX_KERNEL(9) POLYX_KERNEL(10)
+
+static const polyx_kernel polyx_kernels[] = {
+  polyx_eval_0, polyx_eval_1, polyx_eval_2, polyx_eval_3,
+  polyx_eval_4, polyx_eval_5, polyx_eval_6, polyx_eval_7,
+  polyx_eval_8, polyx_eval_9, polyx_eval_10,
+};
+// collage.frag evaluates the same orders
+_Static_assert(sizeof polyx_kernels / sizeof polyx_kernels[0] == POLY_MAX_ORD + 1,
+  "one kernel per order up to POLY_MAX_ORD");
+
+#undef POLYX_KERNEL
+#undef POLYX_TERM
+#undef POLYX_POW
+
+typedef struct polyxform {
+  double rot[3][3];
+  polyx_kernel kernel;
+  bool inverse;
+  double coeff[];
+} polyxform;
+
+polyxform *polyxform_new(double view_ra, double view_dec, int ord, const double *coeff)
+{
+  if (ord < 0 || ord > POLY_MAX_ORD) {
+    printf("Polynomial order %d is not supported (at most %d)\n", ord, POLY_MAX_ORD);
+    exit(1);
+  }
+  int n_coeffs = (ord + 1) * (ord + 2) / 2;
+  polyxform *px = (polyxform *)malloc(
+    sizeof(polyxform) + sizeof(double) * n_coeffs * 2);
+  view_rot(view_ra, view_dec, px->rot);
+  px->kernel = polyx_kernels[ord];
+  px->inverse = false;
+  memcpy(px->coeff, coeff, sizeof(double) * n_coeffs * 2);
+  return px;
+}
+
+// Context for the image -> sky direction, from coefficients fitted by
+// polyfit_inverse()
+polyxform *polyxform_new_inverse(double view_ra, double view_dec, int ord, const double *inv_coeff)
+{
+  polyxform *px = polyxform_new(view_ra, view_dec, ord, inv_coeff);
+  px->inverse = true;
+  return px;
+}
+
+void polyxform_free(polyxform *px)
+{
+  free(px);
+}
+
+// Sky -> image for n points, in place: (u[2k], u[2k+1]) = (RA, Dec) in degrees
+// becomes the image position as fractions of the width and height
+// For an inverse context, image -> sky: the image position becomes (RA, Dec)
+void polyxform_apply(const polyxform *px, int n, double *u)
+{
+  double x[POLYX_BLOCK], y[POLYX_BLOCK];
+  double vx[POLYX_BLOCK], vy[POLYX_BLOCK];
+  for (int k0 = 0; k0 < n; k0 += POLYX_BLOCK) {
+    int nb = (n - k0 < POLYX_BLOCK ? n - k0 : POLYX_BLOCK);
+    for (int k = 0; k < nb; k++) {
+      if (px->inverse) {
+        x[k] = u[(k0 + k) * 2 + 0] - 0.5;
+        y[k] = u[(k0 + k) * 2 + 1] - 0.5;
+      } else {
+        stereo_proj(px->rot, u[(k0 + k) * 2 + 0], u[(k0 + k) * 2 + 1], &x[k], &y[k]);
+      }
     }
-    for (int c = 0; c <= 1; c++) {
-      double sum = 0;
-      for (int i = 0; i <= ord; i++)
-        for (int j = 0; j <= ord - i; j++) {
-          sum += uxpow[i] * uypow[j] * C(c, i, j);
-        }
-      u[k * 2 + c] = sum;
+    // The last block is padded, so that the kernels have a fixed count
+    for (int k = nb; k < POLYX_BLOCK; k++) x[k] = y[k] = 0;
+    px->kernel(px->coeff, x, y, vx, vy);
+    for (int k = 0; k < nb; k++) {
+      if (px->inverse) {
+        stereo_unproj(px->rot, vx[k], vy[k],
+          &u[(k0 + k) * 2 + 0], &u[(k0 + k) * 2 + 1]);
+      } else {
+        u[(k0 + k) * 2 + 0] = vx[k];
+        u[(k0 + k) * 2 + 1] = vy[k];
+      }
     }
   }
 }
 
-static void invert_mul(int n, int m, double *a, double *b, double *c)
+// Inverse fitting
+// The image -> sky direction is fitted as a polynomial from the image
+// position, centred as (vx - 0.5, vy - 0.5), to the stereographic
+// projection, which polyxform_apply() then takes back to the sphere in
+// closed form; a lookup is one polynomial evaluation. The fit is to the
+// forward fit rather than to the matches, so that the two agree: a grid of
+// POLYINV_GRID^2 points over the projected extent of the sky positions
+// given, widened by POLYINV_MARGIN on every side, is mapped forward, and
+// those landing on the image are the samples.
+#define POLYINV_GRID 64
+#define POLYINV_MARGIN 0.1
+
+// Fits the inverse of the fit coeff of order ord over the region of the n
+// sky positions u, at the lowest order from ord up whose round trip
+// image -> sky -> image stays within tol pixels of a w*h image over the
+// samples, or else at the order doing best. As in order selection, the
+// samples are accumulated once at POLY_MAX_ORD and each order is solved on a
+// leading block of one factorisation.
+// o_inv_coeff holds up to (POLY_MAX_ORD + 1) * (POLY_MAX_ORD + 2) values;
+// the RMS and maximum round trip error in pixels go to o_rms and o_max
+// Returns the order of the inverse, or -1 if none could be fitted (as when no
+// sample lands on the image)
+int polyfit_inverse(int n, const double *u, double view_ra, double view_dec,
+  int ord, const double *coeff, int w, int h, double tol,
+  double *o_inv_coeff, double *o_rms, double *o_max)
 {
-  double *aux = (double *)malloc(sizeof(double) * n * (n + m));
-  #define A(_i, _j) aux[(_i) * (n + m) + (_j)]
+  if (ord < 0 || ord > POLY_MAX_ORD) {
+    printf("Polynomial order %d is not supported (at most %d)\n", ord, POLY_MAX_ORD);
+    exit(1);
+  }
+  double rot[3][3];
+  view_rot(view_ra, view_dec, rot);
+  double x_min = INFINITY, x_max = -INFINITY;
+  double y_min = INFINITY, y_max = -INFINITY;
+  for (int k = 0; k < n; k++) {
+    double x, y;
+    stereo_proj(rot, u[k * 2 + 0], u[k * 2 + 1], &x, &y);
+    if (x < x_min) x_min = x;
+    if (x > x_max) x_max = x;
+    if (y < y_min) y_min = y;
+    if (y > y_max) y_max = y;
+  }
+  double x_pad = (x_max - x_min) * POLYINV_MARGIN;
+  double y_pad = (y_max - y_min) * POLYINV_MARGIN;
+  x_min -= x_pad; x_max += x_pad;
+  y_min -= y_pad; y_max += y_pad;
 
-  for (int i = 0; i < n; i++) {
-    for (int j = 0; j < n; j++)
-      A(i, j) = a[i * n + j];
-    for (int j = 0; j < m; j++)
-      A(i, j + n) = b[i * m + j];
+  // Grid in the projection plane, and its image positions
+  const int n_grid = POLYINV_GRID * POLYINV_GRID;
+  double *plane = (double *)malloc(sizeof(double) * n_grid * 2);
+  double *img = (double *)malloc(sizeof(double) * n_grid * 2);
+  double x[POLYX_BLOCK], y[POLYX_BLOCK];
+  double vx[POLYX_BLOCK], vy[POLYX_BLOCK];
+  int n_samples = 0;
+  for (int k0 = 0; k0 < n_grid; k0 += POLYX_BLOCK) {
+    for (int k = 0; k < POLYX_BLOCK; k++) {
+      int i = (k0 + k) % POLYINV_GRID, j = (k0 + k) / POLYINV_GRID;
+      x[k] = x_min + (x_max - x_min) * i / (POLYINV_GRID - 1);
+      y[k] = y_min + (y_max - y_min) * j / (POLYINV_GRID - 1);
+    }
+    polyx_kernels[ord](coeff, x, y, vx, vy);
+    for (int k = 0; k < POLYX_BLOCK; k++) {
+      if (vx[k] < 0 || vx[k] > 1 || vy[k] < 0 || vy[k] > 1) continue;
+      plane[n_samples * 2 + 0] = x[k];
+      plane[n_samples * 2 + 1] = y[k];
+      img[n_samples * 2 + 0] = vx[k] - 0.5;
+      img[n_samples * 2 + 1] = vy[k] - 0.5;
+      n_samples++;
+    }
+  }
+  if (n_samples == 0) {
+    free(plane);
+    free(img);
+    return -1;
   }
 
-  for (int i = 0; i < n; i++) {
-    int pivot = i;
-    double maxabs = fabs(A(i, i));
-    for (int j = i + 1; j < n; j++)
-      if (maxabs < fabs(A(j, i))) {
-        maxabs = fabs(A(j, i));
-        pivot = j;
+  int n_coeffs = (POLY_MAX_ORD + 1) * (POLY_MAX_ORD + 2) / 2;
+  double *XTX = (double *)calloc(n_coeffs * n_coeffs, sizeof(double));
+  double *XTY = (double *)calloc(n_coeffs * 2, sizeof(double));
+  double *b = (double *)malloc(sizeof(double) * n_coeffs * 2);
+  normal_accum(NULL, POLY_MAX_ORD, n_samples, img, plane, 0, 1, XTX, XTY, NULL);
+  for (int i = 0; i < n_coeffs; i++) XTX[i * n_coeffs + i] += 1e-8;
+  int k_max = cholesky_factor(n_coeffs, XTX);
+
+  int best = -1;
+  *o_rms = *o_max = INFINITY;
+  for (int io = ord; io <= POLY_MAX_ORD; io++) {
+    int k_io = (io + 1) * (io + 2) / 2;
+    if (k_io > k_max) break;
+    cholesky_subst(n_coeffs, k_io, 2, XTX, XTY, b);
+
+    // Round trip: image -> plane by the inverse, then -> image by the forward
+    double sum = 0, max = 0;
+    for (int k0 = 0; k0 < n_samples; k0 += POLYX_BLOCK) {
+      int nb = (n_samples - k0 < POLYX_BLOCK ? n_samples - k0 : POLYX_BLOCK);
+      for (int k = 0; k < POLYX_BLOCK; k++) {
+        x[k] = (k < nb ? img[(k0 + k) * 2 + 0] : 0);
+        y[k] = (k < nb ? img[(k0 + k) * 2 + 1] : 0);
       }
-    if (pivot != i)
-      for (int j = i; j < n + m; j++) {
-        double t = A(i, j);
-        A(i, j) = A(pivot, j);
-        A(pivot, j) = t;
+      polyx_kernels[io](b, x, y, vx, vy);
+      polyx_kernels[ord](coeff, vx, vy, x, y);
+      for (int k = 0; k < nb; k++) {
+        double dx = (x[k] - 0.5 - img[(k0 + k) * 2 + 0]) * w;
+        double dy = (y[k] - 0.5 - img[(k0 + k) * 2 + 1]) * h;
+        double dsq = dx * dx + dy * dy;
+        sum += dsq;
+        if (dsq > max) max = dsq;
       }
-    for (int j = i + 1; j < n; j++) {
-      double factor = A(j, i) / A(i, i);
-      for (int k = i; k < n + m; k++)
-        A(j, k) -= factor * A(i, k);
     }
-  }
-  for (int i = n - 1; i >= 0; i--) {
-    for (int j = i + 1; j < n + m; j++)
-      A(i, j) /= A(i, i);
-    A(i, i) = 1;
-    for (int j = 0; j < i; j++)
-      for (int k = n + m - 1; k >= i; k--)
-        A(j, k) -= A(j, i) * A(i, k);
+    max = sqrt(max);
+    if (max < *o_max) {
+      best = io;
+      *o_rms = sqrt(sum / n_samples);
+      *o_max = max;
+      memcpy(o_inv_coeff, b, sizeof(double) * k_io * 2);
+    }
+    if (max <= tol) break;
   }
 
-  for (int i = 0; i < n; i++)
-    for (int j = 0; j < m; j++)
-      c[i * m + j] = A(i, j + n);
+  free(XTX);
+  free(XTY);
+  free(b);
+  free(plane);
+  free(img);
+  return best;
+}
 
-  #undef A
-  free(aux);
+void polyapply(int n, double *u, double view_ra, double view_dec, int ord, double *coeff)
+{
+  polyxform *px = polyxform_new(view_ra, view_dec, ord, coeff);
+  polyxform_apply(px, n, u);
+  polyxform_free(px);
 }
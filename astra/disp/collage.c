@@ -10,6 +10,7 @@
 #include <time.h>
 
 #include "mcmf.h"
+#include "polyterms.h"
 
 static draw_state st;
 
@@ -147,6 +148,8 @@ static inline void load_collage_files()
         &imgs[n_imgs].c_ra, &imgs[n_imgs].c_dec);
       imgs[n_imgs].c_ra *= (M_PI / 180);
       imgs[n_imgs].c_dec *= (M_PI / 180);
+      // The shader holds terms up to POLY_MAX_ORD
+      assert(imgs[n_imgs].order >= 0 && imgs[n_imgs].order <= POLY_MAX_ORD);
       int n_coeffs = (imgs[n_imgs].order + 1) * (imgs[n_imgs].order + 2);
       imgs[n_imgs].coeff = (float *)malloc(sizeof(float) * n_coeffs);
       for (int i = 0; i < n_coeffs; i++)
@@ -1,4 +1,5 @@
 #version 330 core
+#include "polyterms.h"
 #define double float
 #define dvec2 vec2
 in vec2 fragPos;
@@ -11,7 +12,7 @@ uniform bool transp;
 uniform sampler2D image;
 uniform vec2 projCen;
 uniform int ord;
-uniform vec2 coeff[28]; // (6+1) * (7+1) / 2
+uniform vec2 coeff[POLY_N_TERMS];
 
 uniform float aspectRatio;
 uniform vec4 viewOri;
@@ -155,59 +156,22 @@ void main() {
   t = rot(t, vec3(0, 0, 1), -projCen.x);
   t = rot(t, vec3(0, -1, 0), (-pi/2 - projCen.y));
   vec2 u = t.xy / (1 - t.z);
-  // Apply polynomial transform
-  double x2 = u.x * u.x;
-  double y2 = u.y * u.y;
+  // Apply polynomial transform, one degree at a time, with the terms of
+  // each degree listed in polyterms.h; every partial sum from degree 2 on
+  // (and the full one) should stay inside the image
+  double xp[POLY_MAX_ORD + 1], yp[POLY_MAX_ORD + 1];
+  xp[0] = yp[0] = 1;
+  #define POW(_d) xp[_d] = xp[_d - 1] * u.x; yp[_d] = yp[_d - 1] * u.y;
+  POLY_POWS_MAX(POW)
+  #define TERM(_k, _i, _j) texCoord += coeff[_k] * (xp[_i] * yp[_j]);
+  #define DEG(_d, _terms) if (ord >= _d) { _terms(TERM) if (_d >= 2) maxedge = maxedgeupdate(maxedge, texCoord); }
   dvec2 texCoord = dvec2(0);
-  texCoord += coeff[0];
-  texCoord += coeff[1] * u.y;
-  texCoord += coeff[2] * u.x;
-  texCoord += coeff[3] * y2;
-  texCoord += coeff[4] * u.x * u.y;
-  texCoord += coeff[5] * x2;
+  POLY_DEG_0(TERM)
+  POLY_DEGS_MAX(DEG)
   maxedge = maxedgeupdate(maxedge, texCoord);
-  if (ord >= 3) {
-    double x3 = x2 * u.x;
-    double y3 = y2 * u.y;
-    texCoord += coeff[6] * y3;
-    texCoord += coeff[7] * y2 * u.x;
-    texCoord += coeff[8] * u.y * x2;
-    texCoord += coeff[9] * x3;
-    maxedge = maxedgeupdate(maxedge, texCoord);
-    if (ord >= 4) {
-      double x4 = x3 * u.x;
-      double y4 = y3 * u.y;
-      texCoord += coeff[10] * y4;
-      texCoord += coeff[11] * y3 * u.x;
-      texCoord += coeff[12] * y2 * x2;
-      texCoord += coeff[13] * u.y * x3;
-      texCoord += coeff[14] * x4;
-      maxedge = maxedgeupdate(maxedge, texCoord);
-      if (ord >= 5) {
-        double x5 = x4 * u.x;
-        double y5 = y4 * u.y;
-        texCoord += coeff[15] * y5;
-        texCoord += coeff[16] * y4 * u.x;
-        texCoord += coeff[17] * y3 * x2;
-        texCoord += coeff[18] * y2 * x3;
-        texCoord += coeff[19] * u.y * x4;
-        texCoord += coeff[20] * x5;
-        maxedge = maxedgeupdate(maxedge, texCoord);
-        if (ord >= 6) {
-          double x6 = x5 * u.x;
-          double y6 = y5 * u.y;
-          texCoord += coeff[21] * y6;
-          texCoord += coeff[22] * y5 * u.x;
-          texCoord += coeff[23] * y4 * x2;
-          texCoord += coeff[24] * y3 * x3;
-          texCoord += coeff[25] * y2 * x4;
-          texCoord += coeff[26] * u.y * x5;
-          texCoord += coeff[27] * x6;
-          maxedge = maxedgeupdate(maxedge, texCoord);
-        }
-      }
-    }
-  }
+  #undef POW
+  #undef TERM
+  #undef DEG
   if (texCoord.x < 0 || texCoord.x > 1 || texCoord.y < 0 || texCoord.y > 1) discard;
   float maxedgetol = 0.02;
   if (maxedge.x >= maxedgetol || maxedge.y >= maxedgetol) discard;
@@ -33,11 +33,48 @@ static inline char *read_all(const char *path)
   return buf;
 }
 
+// Reads a shader source, replacing each line of the form
+// #include "<path>" with the contents of that file
+static inline char *read_shader(const char *path)
+{
+  char *src = read_all(path);
+  size_t len = 0, cap = strlen(src) + 1;
+  char *out = (char *)malloc(cap);
+  for (char *line = src; *line != '\0'; ) {
+    char *end = strchr(line, '\n');
+    end = (end != NULL ? end + 1 : line + strlen(line));
+    const char *ins = line;
+    size_t ins_len = end - line;
+    char *inc = NULL;
+    if (strncmp(line, "#include \"", 10) == 0) {
+      char *name_end = strchr(line + 10, '"');
+      if (name_end != NULL && name_end < end) {
+        *name_end = '\0';
+        inc = read_shader(line + 10);
+        ins = inc;
+        ins_len = strlen(inc);
+      }
+    }
+    if (len + ins_len + 2 > cap) {
+      while (len + ins_len + 2 > cap) cap *= 2;
+      out = (char *)realloc(out, cap);
+    }
+    memcpy(out + len, ins, ins_len);
+    len += ins_len;
+    if (inc != NULL) out[len++] = '\n';
+    free(inc);
+    line = end;
+  }
+  out[len] = '\0';
+  free(src);
+  return out;
+}
+
 static inline void state_shader_files( 
   draw_state *st, const char *vspath, const char *fspath)
 {
-  char *vs = read_all(vspath);
-  char *fs = read_all(fspath);
+  char *vs = read_shader(vspath);
+  char *fs = read_shader(fspath);
   state_shader(st, vs, fs);
   free(vs);
   free(fs);
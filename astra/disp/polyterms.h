@@ -0,0 +1,70 @@
+// Monomials of the sky-to-image polynomials (see align/polyfit.c)
+// POLY_DEG_d(T) expands to T(k, i, j) for each term x^i y^j of degree d,
+// where k = (i+j)(i+j+1)/2 + i indexes the coefficient pairs as stored in
+// .coeff files; POLY_UPTO_n(T) covers all terms of a polynomial of order n,
+// and POLY_POWS_n(P) expands to P(d) for the powers d = 1..n they use.
+// POLY_DEGS_n(D) expands to D(d, POLY_DEG_d) for d = 1..n, for code that
+// branches on the order at run time, and the _MAX forms are those at
+// POLY_MAX_ORD, which is the highest order either side evaluates.
+// This file is read by both the C compiler (align/polyfit.c) and the GLSL
+// compiler (collage.frag, through state_shader_files()), so it holds only
+// preprocessor lines, each on one line.
+#ifndef POLYTERMS_H
+#define POLYTERMS_H
+
+#define POLY_MAX_ORD 10
+// Coefficient pairs of a polynomial of order POLY_MAX_ORD
+#define POLY_N_TERMS ((POLY_MAX_ORD + 1) * (POLY_MAX_ORD + 2) / 2)
+
+#define POLY_DEG_0(T) T(0, 0, 0)
+#define POLY_DEG_1(T) T(1, 0, 1) T(2, 1, 0)
+#define POLY_DEG_2(T) T(3, 0, 2) T(4, 1, 1) T(5, 2, 0)
+#define POLY_DEG_3(T) T(6, 0, 3) T(7, 1, 2) T(8, 2, 1) T(9, 3, 0)
+#define POLY_DEG_4(T) T(10, 0, 4) T(11, 1, 3) T(12, 2, 2) T(13, 3, 1) T(14, 4, 0)
+#define POLY_DEG_5(T) T(15, 0, 5) T(16, 1, 4) T(17, 2, 3) T(18, 3, 2) T(19, 4, 1) T(20, 5, 0)
+#define POLY_DEG_6(T) T(21, 0, 6) T(22, 1, 5) T(23, 2, 4) T(24, 3, 3) T(25, 4, 2) T(26, 5, 1) T(27, 6, 0)
+#define POLY_DEG_7(T) T(28, 0, 7) T(29, 1, 6) T(30, 2, 5) T(31, 3, 4) T(32, 4, 3) T(33, 5, 2) T(34, 6, 1) T(35, 7, 0)
+#define POLY_DEG_8(T) T(36, 0, 8) T(37, 1, 7) T(38, 2, 6) T(39, 3, 5) T(40, 4, 4) T(41, 5, 3) T(42, 6, 2) T(43, 7, 1) T(44, 8, 0)
+#define POLY_DEG_9(T) T(45, 0, 9) T(46, 1, 8) T(47, 2, 7) T(48, 3, 6) T(49, 4, 5) T(50, 5, 4) T(51, 6, 3) T(52, 7, 2) T(53, 8, 1) T(54, 9, 0)
+#define POLY_DEG_10(T) T(55, 0, 10) T(56, 1, 9) T(57, 2, 8) T(58, 3, 7) T(59, 4, 6) T(60, 5, 5) T(61, 6, 4) T(62, 7, 3) T(63, 8, 2) T(64, 9, 1) T(65, 10, 0)
+
+#define POLY_UPTO_0(T) POLY_DEG_0(T)
+#define POLY_UPTO_1(T) POLY_UPTO_0(T) POLY_DEG_1(T)
+#define POLY_UPTO_2(T) POLY_UPTO_1(T) POLY_DEG_2(T)
+#define POLY_UPTO_3(T) POLY_UPTO_2(T) POLY_DEG_3(T)
+#define POLY_UPTO_4(T) POLY_UPTO_3(T) POLY_DEG_4(T)
+#define POLY_UPTO_5(T) POLY_UPTO_4(T) POLY_DEG_5(T)
+#define POLY_UPTO_6(T) POLY_UPTO_5(T) POLY_DEG_6(T)
+#define POLY_UPTO_7(T) POLY_UPTO_6(T) POLY_DEG_7(T)
+#define POLY_UPTO_8(T) POLY_UPTO_7(T) POLY_DEG_8(T)
+#define POLY_UPTO_9(T) POLY_UPTO_8(T) POLY_DEG_9(T)
+#define POLY_UPTO_10(T) POLY_UPTO_9(T) POLY_DEG_10(T)
+
+#define POLY_POWS_0(P)
+#define POLY_POWS_1(P) POLY_POWS_0(P) P(1)
+#define POLY_POWS_2(P) POLY_POWS_1(P) P(2)
+#define POLY_POWS_3(P) POLY_POWS_2(P) P(3)
+#define POLY_POWS_4(P) POLY_POWS_3(P) P(4)
+#define POLY_POWS_5(P) POLY_POWS_4(P) P(5)
+#define POLY_POWS_6(P) POLY_POWS_5(P) P(6)
+#define POLY_POWS_7(P) POLY_POWS_6(P) P(7)
+#define POLY_POWS_8(P) POLY_POWS_7(P) P(8)
+#define POLY_POWS_9(P) POLY_POWS_8(P) P(9)
+#define POLY_POWS_10(P) POLY_POWS_9(P) P(10)
+
+#define POLY_DEGS_1(D) D(1, POLY_DEG_1)
+#define POLY_DEGS_2(D) POLY_DEGS_1(D) D(2, POLY_DEG_2)
+#define POLY_DEGS_3(D) POLY_DEGS_2(D) D(3, POLY_DEG_3)
+#define POLY_DEGS_4(D) POLY_DEGS_3(D) D(4, POLY_DEG_4)
+#define POLY_DEGS_5(D) POLY_DEGS_4(D) D(5, POLY_DEG_5)
+#define POLY_DEGS_6(D) POLY_DEGS_5(D) D(6, POLY_DEG_6)
+#define POLY_DEGS_7(D) POLY_DEGS_6(D) D(7, POLY_DEG_7)
+#define POLY_DEGS_8(D) POLY_DEGS_7(D) D(8, POLY_DEG_8)
+#define POLY_DEGS_9(D) POLY_DEGS_8(D) D(9, POLY_DEG_9)
+#define POLY_DEGS_10(D) POLY_DEGS_9(D) D(10, POLY_DEG_10)
+
+// Keep in step with POLY_MAX_ORD
+#define POLY_POWS_MAX(P) POLY_POWS_10(P)
+#define POLY_DEGS_MAX(D) POLY_DEGS_10(D)
+
+#endif
@@ -29,6 +29,9 @@ if [ ! -f ./selcrop ]; then
 elif [ ! -f ../align/align ]; then
   echo "Please build ../align/align first"
   exit 1
+elif [ ! -f ../align/automatch ]; then
+  echo "Please build ../align/automatch first"
+  exit 1
 elif ! command $solve_field &>/dev/null; then
   echo "Command \"$solve_field\" is not valid. Please properly set \$solve_field to point to the astrometry.net installation."
   exit 1
@@ -57,13 +60,22 @@ for i in $images; do
   fi
 done
 
+# Matches are found automatically; the alignment GUI opens only for images
+# where that fails, and "./pipeline.sh <name>" opens it for review
 echo "(3/3) Refine alignment"
 for i in $images; do
   bn=`basename $i`
   n=${bn%.*}
   if [ -f "$img_proc/$n.solved" ] && [ ! -f "$img_proc/$n.coeff" ]; then
     echo $bn
-    ../align/align \
+    ../align/automatch \
+      $img_proc/$n.axy \
+      $img_proc/$n.rdls \
+      $img_proc/$n.corr \
+      $img_proc/$n.wcs \
+      $img_proc/$n.refi \
+      $img_proc/$n.coeff \
+    || ../align/align \
       $img_proc/$n.png \
       $img_proc/$n.axy \
       $img_proc/$n.rdls \